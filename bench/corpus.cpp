@@ -0,0 +1,103 @@
+#include "corpus.h"
+
+#include <algorithm>
+#include <cmath>
+#include <filesystem>
+#include <fstream>
+#include <map>
+
+#include "lib/index.h"
+
+bench::ZipfCorpus::ZipfCorpus(size_t vocabulary, double exponent,
+                              uint64_t seed)
+    : cdf_(vocabulary), state_(seed) {
+  double sum = 0;
+  for (size_t i = 0; i < vocabulary; ++i) {
+    sum += 1 / std::pow(i + 1, exponent);
+    cdf_[i] = sum;
+  }
+  for (double& p : cdf_) {
+    p /= sum;
+  }
+}
+
+// SplitMix64, std distributions differ between standard libraries.
+uint64_t bench::ZipfCorpus::NextRandom() {
+  uint64_t z = (state_ += 0x9e3779b97f4a7c15ull);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+  return z ^ (z >> 31);
+}
+
+std::string bench::ZipfCorpus::Term(size_t rank) {
+  std::string term;
+  for (++rank; rank != 0; rank = (rank - 1) / 26) {
+    term += static_cast<char>('a' + (rank - 1) % 26);
+  }
+  return term;
+}
+
+size_t bench::ZipfCorpus::NextRank() {
+  double p = (NextRandom() >> 11) * 0x1.0p-53;
+  return std::min<size_t>(
+      std::lower_bound(cdf_.begin(), cdf_.end(), p) - cdf_.begin(),
+      cdf_.size() - 1);
+}
+
+size_t bench::ZipfCorpus::NextBelow(size_t n) { return NextRandom() % n; }
+
+std::string bench::ZipfCorpus::Document(size_t words) {
+  const char punctuation[] = ",.;:()";
+  std::string text;
+  size_t length = words / 2 + NextBelow(words + 1);
+  for (size_t i = 0; i < length; ++i) {
+    text += Term(NextRank());
+    if (NextBelow(16) == 0) {
+      text += punctuation[NextBelow(sizeof(punctuation) - 1)];
+    }
+    text += i % 12 == 11 ? '\n' : ' ';
+  }
+  return text;
+}
+
+void bench::ZipfCorpus::Write(const std::string& directory, size_t documents,
+                              size_t words) {
+  std::filesystem::create_directories(directory);
+  for (size_t i = 0; i < documents; ++i) {
+    // Groups of a thousand files per directory, as in a source tree.
+    std::string path = directory + "/" + std::to_string(i / 1000);
+    if (i % 1000 == 0) {
+      std::filesystem::create_directories(path);
+    }
+    std::ofstream(path + "/" + std::to_string(i) + ".txt", std::ios::binary)
+        << Document(words);
+  }
+}
+
+const std::string& bench::IndexedCorpus(size_t documents) {
+  static std::map<size_t, std::string> corpora;
+  auto it = corpora.find(documents);
+  if (it != corpora.end()) {
+    return it->second;
+  }
+  std::string directory = (std::filesystem::temp_directory_path() /
+                           "ii_bench" / std::to_string(documents))
+                              .string();
+  std::filesystem::remove_all(directory);
+  ZipfCorpus(vocabulary).Write(directory + "/files", documents,
+                               document_words);
+  WorkingDirectory cwd(directory);
+  std::vector<const char*> args{"index_launcher", "-i", "files"};
+  ii::InvertedIndex index;
+  index.Launcher(args.size(), const_cast<char**>(args.data()));
+  return corpora[documents] = directory;
+}
+
+bench::WorkingDirectory::WorkingDirectory(const std::string& directory)
+    : previous_(std::filesystem::current_path().string()) {
+  std::filesystem::current_path(directory);
+}
+
+bench::WorkingDirectory::~WorkingDirectory() {
+  std::filesystem::current_path(previous_);
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace bench {
+
+// Deterministic synthetic text for benchmarks. Words are drawn from a
+// vocabulary whose rank-frequency curve follows Zipf's law with the given
+// exponent, like natural language and source code roughly do, and the same
+// seed always gives the same bytes on every platform.
+class ZipfCorpus {
+  std::vector<double> cdf_;
+  uint64_t state_;
+
+  uint64_t NextRandom();
+
+ public:
+  ZipfCorpus(size_t vocabulary, double exponent = 1.0, uint64_t seed = 1);
+
+  // Spelling of the term of a rank, the most frequent term has rank 0.
+  static std::string Term(size_t rank);
+
+  size_t NextRank();
+
+  // Uniform in [0, n).
+  size_t NextBelow(size_t n);
+
+  // Document of about words words, a dozen per line, with some trailing
+  // punctuation for the tokenizer to strip.
+  std::string Document(size_t words);
+
+  // Writes documents files of about words words each under directory.
+  void Write(const std::string& directory, size_t documents, size_t words);
+};
+
+constexpr size_t vocabulary = 1 << 16;
+constexpr size_t document_words = 100;
+
+// Directory with a corpus of documents files under files/ and its index under
+// info/, built once per process with default settings.
+const std::string& IndexedCorpus(size_t documents);
+
+// Changes the working directory for the lifetime of the object, the engine
+// and the indexer find the index relative to it.
+class WorkingDirectory {
+  std::string previous_;
+
+ public:
+  WorkingDirectory(const std::string& directory);
+
+  ~WorkingDirectory();
+};
+
+}  // namespace bench
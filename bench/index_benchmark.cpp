@@ -0,0 +1,204 @@
+#include <benchmark/benchmark.h>
+
+#include <cstring>
+#include <filesystem>
+#include <sstream>
+
+#include "bench/corpus.h"
+#include "lib/index.h"
+
+namespace {
+
+std::vector<std::string> Documents(size_t documents) {
+  bench::ZipfCorpus corpus(bench::vocabulary);
+  std::vector<std::string> texts;
+  for (size_t i = 0; i < documents; ++i) {
+    texts.push_back(corpus.Document(bench::document_words));
+  }
+  return texts;
+}
+
+size_t Bytes(const std::vector<std::string>& texts) {
+  size_t bytes = 0;
+  for (const auto& text : texts) {
+    bytes += text.size();
+  }
+  return bytes;
+}
+
+struct Token {
+  std::string_view term;
+  size_t DID;
+  size_t position;
+};
+
+// Tokenized texts, the views point into texts.
+std::vector<Token> Tokens(std::vector<std::string>& texts) {
+  std::vector<Token> tokens;
+  for (size_t DID = 0; DID < texts.size(); ++DID) {
+    ii::Tokenizer tokenizer(texts[DID].data(),
+                            texts[DID].data() + texts[DID].size());
+    size_t position = 0;
+    for (std::string_view term; tokenizer.Next(term);) {
+      tokens.push_back({term, DID, position++});
+    }
+  }
+  return tokens;
+}
+
+std::string RunPath() {
+  return (std::filesystem::temp_directory_path() / "ii_bench_segment_")
+      .string();
+}
+
+void BM_Tokenize(benchmark::State& state) {
+  std::vector<std::string> texts = Documents(state.range(0));
+  std::string buffer;
+  size_t tokens = 0;
+  for (auto _ : state) {
+    for (const auto& text : texts) {
+      // The tokenizer works in place, the copy costs little next to it.
+      buffer.assign(text);
+      ii::Tokenizer tokenizer(buffer.data(), buffer.data() + buffer.size());
+      for (std::string_view term; tokenizer.Next(term);) {
+        benchmark::DoNotOptimize(term);
+        ++tokens;
+      }
+    }
+  }
+  state.SetBytesProcessed(state.iterations() * Bytes(texts));
+  state.SetItemsProcessed(tokens);
+}
+BENCHMARK(BM_Tokenize)
+    ->Arg(1 << 10)
+    ->Arg(1 << 13)
+    ->Unit(benchmark::kMillisecond);
+
+void BM_Invert(benchmark::State& state) {
+  std::vector<std::string> texts = Documents(state.range(0));
+  std::vector<Token> tokens = Tokens(texts);
+  for (auto _ : state) {
+    ii::Segment segment(RunPath(), size_t(1) << 40);
+    for (const auto& token : tokens) {
+      segment.Add(token.term, token.DID, token.position);
+    }
+    benchmark::DoNotOptimize(segment.Size());
+  }
+  state.SetItemsProcessed(state.iterations() * tokens.size());
+}
+BENCHMARK(BM_Invert)
+    ->Arg(1 << 10)
+    ->Arg(1 << 13)
+    ->Arg(1 << 15)
+    ->Unit(benchmark::kMillisecond);
+
+// Sorting the terms of a full segment and writing them out as a run.
+void BM_Flush(benchmark::State& state) {
+  std::vector<std::string> texts = Documents(state.range(0));
+  std::vector<Token> tokens = Tokens(texts);
+  for (auto _ : state) {
+    state.PauseTiming();
+    ii::Segment segment(RunPath(), size_t(1) << 40);
+    for (const auto& token : tokens) {
+      segment.Add(token.term, token.DID, token.position);
+    }
+    state.ResumeTiming();
+    segment.Update();
+    state.PauseTiming();
+    segment.RemoveRuns();
+    state.ResumeTiming();
+  }
+  state.SetItemsProcessed(state.iterations() * tokens.size());
+}
+BENCHMARK(BM_Flush)
+    ->Arg(1 << 10)
+    ->Arg(1 << 13)
+    ->Arg(1 << 15)
+    ->Unit(benchmark::kMillisecond);
+
+// Whole index builds on one thread: crawl, read, invert, flush and merge. The
+// second argument is the memory budget in KiB, small budgets flush many runs
+// and merge them. Reads overlap with inverting, so wall time counts.
+void BM_Build(benchmark::State& state) {
+  const std::string& directory = bench::IndexedCorpus(state.range(0));
+  std::string budget = std::to_string(state.range(1)) + "K";
+  bench::WorkingDirectory cwd(directory);
+  std::vector<const char*> args{"index_launcher", "-i", "files", "-j", "1",
+                                "--mem-budget", budget.c_str()};
+  for (auto _ : state) {
+    ii::InvertedIndex index;
+    index.Launcher(args.size(), const_cast<char**>(args.data()));
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_Build)
+    ->Args({1 << 10, 256 << 10})
+    ->Args({1 << 13, 256 << 10})
+    ->Args({1 << 13, 1 << 10})
+    ->Args({1 << 15, 256 << 10})
+    ->Args({1 << 15, 1 << 10})
+    ->UseRealTime()
+    ->Unit(benchmark::kMillisecond);
+
+// Gaps of a posting list of density 1 / 16 and tfs, the value mix the
+// posting tables hold.
+std::vector<size_t> PostingValues(size_t n) {
+  bench::ZipfCorpus corpus(64);
+  std::vector<size_t> values;
+  for (size_t i = 0; i < n; ++i) {
+    values.push_back(i % 2 ? corpus.NextRank() + 1 : corpus.NextBelow(32) + 1);
+  }
+  return values;
+}
+
+void BM_Encode(benchmark::State& state) {
+  ii::Codec codec = static_cast<ii::Codec>(state.range(0));
+  std::vector<size_t> values = PostingValues(1 << 20);
+  size_t bytes = 0;
+  for (auto _ : state) {
+    std::ostringstream out;
+    ii::BlockEncoder encoder(codec, out);
+    for (size_t value : values) {
+      encoder.Add(value);
+    }
+    encoder.Flush();
+    bytes = out.tellp();
+    benchmark::DoNotOptimize(bytes);
+  }
+  state.SetItemsProcessed(state.iterations() * values.size());
+  state.counters["bytes_per_value"] = double(bytes) / values.size();
+}
+BENCHMARK(BM_Encode)
+    ->Arg(static_cast<int>(ii::Codec::Varint))
+    ->Arg(static_cast<int>(ii::Codec::StreamVByte))
+    ->Unit(benchmark::kMillisecond);
+
+void BM_Decode(benchmark::State& state) {
+  ii::Codec codec = static_cast<ii::Codec>(state.range(0));
+  std::vector<size_t> values = PostingValues(1 << 20);
+  std::ostringstream out;
+  ii::BlockEncoder encoder(codec, out);
+  for (size_t value : values) {
+    encoder.Add(value);
+  }
+  encoder.Flush();
+  std::string data = out.str();
+  const uint8_t* begin = reinterpret_cast<const uint8_t*>(data.data());
+  for (auto _ : state) {
+    ii::Cursor cursor(begin, begin + data.size());
+    ii::BlockDecoder decoder(codec);
+    size_t sum = 0;
+    for (size_t i = 0; i < values.size(); ++i) {
+      sum += decoder.Next(cursor);
+    }
+    benchmark::DoNotOptimize(sum);
+  }
+  state.SetItemsProcessed(state.iterations() * values.size());
+  state.SetBytesProcessed(state.iterations() * data.size());
+}
+BENCHMARK(BM_Decode)
+    ->Arg(static_cast<int>(ii::Codec::Varint))
+    ->Arg(static_cast<int>(ii::Codec::StreamVByte))
+    ->Unit(benchmark::kMillisecond);
+
+}  // namespace
@@ -0,0 +1,118 @@
+#include <benchmark/benchmark.h>
+
+#include <sstream>
+
+#include "bench/corpus.h"
+#include "lib/search.h"
+
+namespace {
+
+constexpr size_t query_count = 64;
+
+// Query terms follow a Zipf law of their own, so most queries hit long
+// posting lists the way real query logs do.
+std::vector<std::string> Queries(const std::string& op, size_t terms) {
+  bench::ZipfCorpus corpus(bench::vocabulary, 1.0, 2);
+  std::vector<std::string> queries;
+  for (size_t i = 0; i < query_count; ++i) {
+    std::string query;
+    for (size_t j = 0; j < terms; ++j) {
+      query += (j == 0 ? "" : " " + op + " ") +
+               bench::ZipfCorpus::Term(corpus.NextRank());
+    }
+    queries.push_back(query);
+  }
+  return queries;
+}
+
+// Runs the queries round robin against the index of a corpus. Cached results
+// would only measure the cache, decoded postings are kept as when serving.
+void RunQueries(benchmark::State& state,
+                const std::vector<std::string>& queries, size_t k,
+                bool exhaustive, size_t threads = 1) {
+  bench::WorkingDirectory cwd(bench::IndexedCorpus(state.range(0)));
+  sse::SimpleSearchEngine engine;
+  if (!engine.Open()) {
+    state.SkipWithError("Index not found");
+    return;
+  }
+  engine.SetCacheSize(0);
+  engine.SetExhaustive(exhaustive);
+  engine.SetQueryThreads(threads);
+  std::ostringstream out;
+  size_t i = 0;
+  for (auto _ : state) {
+    std::string query = queries[i++ % queries.size()];
+    out.str("");
+    engine.Request(query, k, out);
+    benchmark::DoNotOptimize(out.tellp());
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+void BM_DictionaryLookup(benchmark::State& state) {
+  bench::WorkingDirectory cwd(bench::IndexedCorpus(state.range(0)));
+  ii::SegmentFiles files("info/");
+  ii::Dictionary dictionary;
+  if (!dictionary.Open(files.term_info_path, files.term_index_path)) {
+    state.SkipWithError("Index not found");
+    return;
+  }
+  // Uniform over the vocabulary, so rare terms and misses are looked up as
+  // often as frequent terms.
+  bench::ZipfCorpus corpus(bench::vocabulary, 1.0, 3);
+  std::vector<std::string> terms;
+  for (size_t i = 0; i < 1024; ++i) {
+    terms.push_back(
+        bench::ZipfCorpus::Term(corpus.NextBelow(bench::vocabulary)));
+  }
+  size_t i = 0;
+  size_t found = 0;
+  for (auto _ : state) {
+    ii::TermEntry entry;
+    found += dictionary.Find(terms[i++ % terms.size()], entry);
+  }
+  state.SetItemsProcessed(state.iterations());
+  state.counters["hit_rate"] = double(found) / state.iterations();
+  state.counters["terms"] = dictionary.Size();
+}
+BENCHMARK(BM_DictionaryLookup)->Arg(1 << 10)->Arg(1 << 13)->Arg(1 << 15);
+
+void BM_And(benchmark::State& state) {
+  RunQueries(state, Queries("AND", 2), 10, true);
+}
+BENCHMARK(BM_And)
+    ->Arg(1 << 10)
+    ->Arg(1 << 13)
+    ->Arg(1 << 15)
+    ->Unit(benchmark::kMicrosecond);
+
+void BM_Or(benchmark::State& state) {
+  RunQueries(state, Queries("OR", 2), 10, true);
+}
+BENCHMARK(BM_Or)
+    ->Arg(1 << 10)
+    ->Arg(1 << 13)
+    ->Arg(1 << 15)
+    ->Unit(benchmark::kMicrosecond);
+
+// Top-k of three term disjunctions with block-max WAND, the second argument
+// is k.
+void BM_TopK(benchmark::State& state) {
+  RunQueries(state, Queries("OR", 3), state.range(1), false);
+}
+BENCHMARK(BM_TopK)
+    ->ArgsProduct({{1 << 10, 1 << 13, 1 << 15}, {10, 100, 1000}})
+    ->Unit(benchmark::kMicrosecond);
+
+// Top-10 of exhaustive disjunctions split over DID ranges, the second
+// argument is the number of query threads. Light queries stay on one.
+void BM_QueryThreads(benchmark::State& state) {
+  RunQueries(state, Queries("OR", 3), 10, true, state.range(1));
+}
+BENCHMARK(BM_QueryThreads)
+    ->ArgsProduct({{1 << 15}, {1, 2, 4}})
+    ->UseRealTime()
+    ->Unit(benchmark::kMicrosecond);
+
+}  // namespace
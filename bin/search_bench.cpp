@@ -0,0 +1,314 @@
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <set>
+#include <sstream>
+
+#include "lib/search.h"
+
+using namespace sse;
+
+// Decodes every posting and position list of the base segment and reports
+// the throughput together with the size of the tables on disk.
+int Decode(size_t repeat) {
+  ii::SegmentFiles files("info/");
+  ii::Dictionary dictionary;
+  ii::MappedFile posting_file;
+  ii::MappedFile position_file;
+  ii::MappedFile segments;
+  if (!dictionary.Open(files.term_info_path, files.term_index_path) ||
+      !posting_file.Open(files.posting_table_path) ||
+      !position_file.Open(files.position_table_path) ||
+      !segments.Open("info/segments.bin")) {
+    std::cerr << "Index not found\n";
+    return 1;
+  }
+  ii::Cursor cursor = segments.At(0);
+  cursor.ReadVarint();
+  ii::Codec codec = cursor.AtEnd()
+                        ? ii::Codec::Varint
+                        : static_cast<ii::Codec>(cursor.ReadVarint());
+  size_t values = 0;
+  size_t checksum = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (size_t r = 0; r < repeat; ++r) {
+    ii::DictionaryIterator it = dictionary.Iterate();
+    ii::TermEntry entry;
+    while (it.Next(entry)) {
+      ii::PostingReader posting(codec, posting_file.At(entry.posting_ind),
+                                entry.df);
+      ii::PositionReader position(codec,
+                                  position_file.At(entry.position_ind));
+      size_t DID;
+      size_t tf;
+      while (posting.Next(DID, tf)) {
+        checksum += DID;
+        for (size_t i = 0; i < tf; ++i) {
+          checksum += position.Next();
+        }
+        values += 2 + tf;
+      }
+    }
+  }
+  double seconds = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - start)
+                       .count();
+  size_t bytes = posting_file.Size() + position_file.Size();
+  std::cout << "codec: "
+            << (codec == ii::Codec::Varint ? "varint" : "streamvbyte") << '\n';
+  std::cout << "posting_table: " << posting_file.Size() << " bytes\n";
+  std::cout << "position_table: " << position_file.Size() << " bytes\n";
+  std::cout << "decoded: " << values << " values, checksum " << checksum
+            << '\n';
+  std::cout << "speed: " << bytes * repeat / seconds / (1 << 20) << " MB/s, "
+            << values / seconds / 1e6 << " Mvalues/s\n";
+  return 0;
+}
+
+// Splits every file under a directory into terms with the tokenizer and with
+// the stringstream splitting the indexer used before it, on one core.
+int Tokenize(const std::string& directory, size_t repeat) {
+  std::vector<std::string> texts;
+  size_t bytes = 0;
+  for (const auto& file :
+       std::filesystem::recursive_directory_iterator(directory)) {
+    if (!file.is_directory()) {
+      std::ifstream input(file.path(), std::ios::binary);
+      texts.emplace_back(std::istreambuf_iterator<char>(input),
+                         std::istreambuf_iterator<char>());
+      bytes += texts.back().size();
+    }
+  }
+  size_t terms = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (size_t r = 0; r < repeat; ++r) {
+    for (const auto& text : texts) {
+      std::istringstream input(text);
+      for (std::string line; std::getline(input, line);) {
+        std::stringstream words(line);
+        for (std::string term; words >> term;) {
+          terms += ii::NormalizeTerm(term);
+        }
+      }
+    }
+  }
+  double stream_seconds = std::chrono::duration<double>(
+                              std::chrono::steady_clock::now() - start)
+                              .count();
+  size_t tokens = 0;
+  double seconds = 0;
+  for (size_t r = 0; r < repeat; ++r) {
+    for (std::string text : texts) {
+      auto start = std::chrono::steady_clock::now();
+      ii::Tokenizer tokenizer(text.data(), text.data() + text.size());
+      for (std::string_view term; tokenizer.Next(term);) {
+        ++tokens;
+      }
+      seconds += std::chrono::duration<double>(
+                     std::chrono::steady_clock::now() - start)
+                     .count();
+    }
+  }
+  if (tokens != terms) {
+    std::cerr << "Tokenizers disagree: " << tokens << " vs " << terms << '\n';
+    return 1;
+  }
+  double mb = (double)bytes * repeat / (1 << 20);
+  std::cout << "files: " << texts.size() << ", " << bytes << " bytes, "
+            << terms / repeat << " terms\n";
+  std::cout << "stringstream: " << mb / stream_seconds << " MB/s\n";
+  std::cout << "tokenizer: " << mb / seconds << " MB/s\n";
+  return 0;
+}
+
+// Scores OR queries over the 1, 2, 4, ... 32 most frequent terms and reports
+// how throughput of the scoring loop scales with the number of terms.
+int Terms(size_t repeat) {
+  ii::Dictionary dictionary;
+  if (!dictionary.Open("info/term.bin", "info/term_index.bin")) {
+    std::cerr << "Index not found\n";
+    return 1;
+  }
+  std::vector<ii::TermEntry> terms;
+  ii::DictionaryIterator it = dictionary.Iterate();
+  for (ii::TermEntry entry; it.Next(entry);) {
+    terms.push_back(entry);
+  }
+  std::sort(terms.begin(), terms.end(),
+            [](const ii::TermEntry& a, const ii::TermEntry& b) {
+              return a.df > b.df;
+            });
+  std::ostream null(nullptr);
+  std::cout << "terms\tmode\tus/query\tMpostings/s\n";
+  for (size_t n = 1; n <= 32 && n <= terms.size(); n *= 2) {
+    std::string query;
+    size_t postings = 0;
+    for (size_t i = 0; i < n; ++i) {
+      query += (i == 0 ? "" : " OR ") + terms[i].term;
+      postings += terms[i].df;
+    }
+    for (bool exhaustive : {true, false}) {
+      SimpleSearchEngine e;
+      e.SetExhaustive(exhaustive);
+      e.SetCacheSize(0);
+      e.SetPostingCacheSize(0);
+      e.Open();
+      auto start = std::chrono::steady_clock::now();
+      for (size_t r = 0; r < repeat; ++r) {
+        std::string request = query;
+        e.Request(request, 10, null, null);
+      }
+      double us = std::chrono::duration<double, std::micro>(
+                      std::chrono::steady_clock::now() - start)
+                      .count() /
+                  repeat;
+      std::cout << n << '\t' << (exhaustive ? "exhaustive" : "pruned") << '\t'
+                << us << '\t' << postings / us << '\n';
+    }
+  }
+  return 0;
+}
+
+// Ranks every query with quantized impacts and with exact BM25 and reports
+// how much of the exact top k the impacts keep, and what each costs.
+int Evaluate(const std::vector<std::pair<size_t, std::string>>& queries,
+             size_t repeat) {
+  SimpleSearchEngine impact;
+  SimpleSearchEngine exact;
+  exact.SetExact(true);
+  for (SimpleSearchEngine* e : {&impact, &exact}) {
+    e->SetCacheSize(0);
+    e->SetPostingCacheSize(0);
+  }
+  if (!impact.Open() || !exact.Open()) {
+    std::cerr << "Index not found\n";
+    return 1;
+  }
+  auto run = [](SimpleSearchEngine& e, std::string query, size_t k) {
+    std::ostringstream out;
+    std::ostream null(nullptr);
+    e.Request(query, k, out, null);
+    std::vector<std::string> paths;
+    std::istringstream lines(out.str());
+    for (std::string line; std::getline(lines, line);) {
+      paths.push_back(line.substr(0, line.find(' ')));
+    }
+    return paths;
+  };
+  double overlap = 0;
+  size_t same_top = 0;
+  size_t same_ranking = 0;
+  for (auto [k, query] : queries) {
+    std::vector<std::string> expected = run(exact, query, k);
+    std::vector<std::string> found = run(impact, query, k);
+    std::set<std::string> expected_set(expected.begin(), expected.end());
+    size_t common = 0;
+    for (const auto& path : found) {
+      common += expected_set.contains(path);
+    }
+    overlap += expected.empty() ? 1 : (double)common / expected.size();
+    same_top += expected.empty() || (!found.empty() && found[0] == expected[0]);
+    same_ranking += found == expected;
+  }
+  auto time = [&queries, repeat](SimpleSearchEngine& e) {
+    std::ostream null(nullptr);
+    auto start = std::chrono::steady_clock::now();
+    for (size_t r = 0; r < repeat; ++r) {
+      for (auto [k, query] : queries) {
+        e.Request(query, k, null, null);
+      }
+    }
+    return std::chrono::duration<double, std::micro>(
+               std::chrono::steady_clock::now() - start)
+               .count() /
+           (queries.size() * repeat);
+  };
+  std::cout << "queries: " << queries.size() << '\n';
+  std::cout << "overlap@k: " << overlap / queries.size() << '\n';
+  std::cout << "same top result: " << same_top << '\n';
+  std::cout << "same ranking: " << same_ranking << '\n';
+  std::cout << "exact: " << time(exact) << " us/query\n";
+  std::cout << "impact: " << time(impact) << " us/query\n";
+  return 0;
+}
+
+int main(int argc, char** argv) {
+  if (argc < 2) {
+    std::cerr << "Usage: search_bench <queries> [repeat] "
+                 "[--exhaustive|--evaluate]\n"
+              << "       search_bench --decode [repeat]\n"
+              << "       search_bench --terms [repeat]\n"
+              << "       search_bench --tokenize <directory> [repeat]\n";
+    return 1;
+  }
+  if (!strcmp(argv[1], "--decode")) {
+    return Decode(argc > 2 ? std::stoull(argv[2]) : 10);
+  }
+  if (!strcmp(argv[1], "--tokenize") && argc > 2) {
+    return Tokenize(argv[2], argc > 3 ? std::stoull(argv[3]) : 10);
+  }
+  if (!strcmp(argv[1], "--terms")) {
+    return Terms(argc > 2 ? std::stoull(argv[2]) : 10);
+  }
+  std::vector<std::pair<size_t, std::string>> queries;
+  std::ifstream file(argv[1]);
+  std::string line;
+  std::string request;
+  while (std::getline(file, line) && std::getline(file, request)) {
+    queries.emplace_back(std::stoull(line), request);
+  }
+  size_t repeat = argc > 2 ? std::stoull(argv[2]) : 10;
+  bool exhaustive = argc > 3 && !strcmp(argv[3], "--exhaustive");
+  if (queries.empty()) {
+    std::cerr << "No queries\n";
+    return 1;
+  }
+  if (argc > 3 && !strcmp(argv[3], "--evaluate")) {
+    return Evaluate(queries, repeat);
+  }
+  std::ostream null(nullptr);
+
+  auto start = std::chrono::steady_clock::now();
+  for (size_t r = 0; r < repeat; ++r) {
+    for (auto [k, query] : queries) {
+      SimpleSearchEngine e;
+      e.SetExhaustive(exhaustive);
+      e.SetCacheSize(0);
+      e.SetPostingCacheSize(0);
+      e.Request(query, k, null, null);
+    }
+  }
+  auto cold = std::chrono::steady_clock::now() - start;
+
+  // Warm runs keep the index open, the last one also keeps decoded posting
+  // lists of repeated terms.
+  auto warm_run = [&](size_t posting_cache) {
+    SimpleSearchEngine e;
+    e.SetExhaustive(exhaustive);
+    e.SetCacheSize(0);
+    e.SetPostingCacheSize(posting_cache);
+    e.Open();
+    auto start = std::chrono::steady_clock::now();
+    for (size_t r = 0; r < repeat; ++r) {
+      for (auto [k, query] : queries) {
+        e.Request(query, k, null, null);
+      }
+    }
+    return std::chrono::steady_clock::now() - start;
+  };
+  auto warm = warm_run(0);
+  auto decoded = warm_run(256 << 20);
+
+  size_t total = queries.size() * repeat;
+  auto per_query = [total](auto duration) {
+    return std::chrono::duration<double, std::micro>(duration).count() / total;
+  };
+  std::cout << "queries: " << total << '\n';
+  std::cout << "cold: " << per_query(cold) << " us/query\n";
+  std::cout << "warm: " << per_query(warm) << " us/query\n";
+  std::cout << "warm, decoded postings: " << per_query(decoded)
+            << " us/query\n";
+}
@@ -1,29 +1,182 @@
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
 #include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
 
 #include "lib/index.h"
 #include "lib/search.h"
 
 using namespace sse;
 
+bool SendAll(int client, const std::string& data) {
+  // A client that hung up must not take the server down with SIGPIPE.
+  for (size_t sent = 0; sent < data.size();) {
+    ssize_t size =
+        send(client, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+    if (size <= 0) {
+      return false;
+    }
+    sent += size;
+  }
+  return true;
+}
+
+// Answers every pair of lines of a client, k and the request, as soon as it
+// arrives, so a client may wait for an answer before it sends more.
+void ServeClient(SimpleSearchEngine& e, int client) {
+  std::string input;
+  std::vector<std::string> lines;
+  char buffer[4096];
+  bool open = true;
+  while (open) {
+    ssize_t size = read(client, buffer, sizeof(buffer));
+    if (size == -1 && errno == EINTR) {
+      continue;
+    }
+    if (size > 0) {
+      input.append(buffer, size);
+    } else {
+      open = false;
+      if (!input.empty()) {
+        input += '\n';
+      }
+    }
+    size_t begin = 0;
+    for (size_t end; (end = input.find('\n', begin)) != std::string::npos;
+         begin = end + 1) {
+      lines.emplace_back(input, begin, end - begin);
+      if (lines.size() == 2) {
+        std::istringstream in(lines[0] + '\n' + lines[1] + '\n');
+        std::ostringstream out;
+        e.Serve(in, out, out);
+        lines.clear();
+        if (!SendAll(client, out.str())) {
+          return;
+        }
+      }
+    }
+    input.erase(0, begin);
+  }
+}
+
+int ServeSocket(SimpleSearchEngine& e, const std::string& path) {
+  int server = socket(AF_UNIX, SOCK_STREAM, 0);
+  sockaddr_un address{};
+  address.sun_family = AF_UNIX;
+  if (server == -1 || path.size() >= sizeof(address.sun_path)) {
+    std::cerr << "Invalid socket" << std::endl;
+    return 1;
+  }
+  std::strcpy(address.sun_path, path.c_str());
+  unlink(path.c_str());
+  if (bind(server, reinterpret_cast<sockaddr*>(&address), sizeof(address)) ==
+          -1 ||
+      listen(server, 16) == -1) {
+    std::cerr << "Invalid socket" << std::endl;
+    close(server);
+    return 1;
+  }
+  while (true) {
+    int client = accept(server, nullptr, nullptr);
+    if (client == -1) {
+      continue;
+    }
+    ServeClient(e, client);
+    close(client);
+  }
+}
+
+void ReportSession(const SimpleSearchEngine& e, bool stats) {
+  if (stats) {
+    e.Session().Write(std::cerr);
+    std::cerr << std::endl;
+  }
+}
+
 int main(int argc, char** argv) {
   SimpleSearchEngine e;
+  // --stats may come anywhere and prints a JSON line per request and one for
+  // the session to stderr. -j runs the requests of a batch on that many
+  // threads, --query-threads splits heavy requests over that many.
+  bool stats = false;
+  size_t threads = 1;
+  size_t query_threads = 1;
+  int args = 1;
+  for (int i = 1; i < argc; ++i) {
+    if (!strcmp(argv[i], "--stats")) {
+      stats = true;
+    } else if (!strcmp(argv[i], "-j") && i + 1 < argc) {
+      char* end;
+      threads = std::strtoull(argv[++i], &end, 10);
+      if (*end != '\0' || threads == 0) {
+        std::cerr << "Invalid Arguments" << std::endl;
+        return 1;
+      }
+    } else if (!strcmp(argv[i], "--query-threads") && i + 1 < argc) {
+      char* end;
+      query_threads = std::strtoull(argv[++i], &end, 10);
+      if (*end != '\0' || query_threads == 0) {
+        std::cerr << "Invalid Arguments" << std::endl;
+        return 1;
+      }
+    } else {
+      argv[args++] = argv[i];
+    }
+  }
+  argc = args;
+  e.SetQueryThreads(query_threads);
+  if (stats) {
+    e.SetStatsOutput(&std::cerr);
+  }
+  if (argc > 1 && !strcmp(argv[1], "--serve")) {
+    if (!e.Open()) {
+      std::cerr << "Index not found" << std::endl;
+      return 1;
+    }
+    e.Serve(std::cin, std::cout, std::cerr);
+    ReportSession(e, stats);
+    return 0;
+  }
+  if (argc == 3 && !strcmp(argv[1], "--socket")) {
+    if (!e.Open()) {
+      std::cerr << "Index not found" << std::endl;
+      return 1;
+    }
+    return ServeSocket(e, argv[2]);
+  }
   std::string request;
   size_t n;
   std::cin >> n;
   std::getline(std::cin, request);
+  // Requests up to the first malformed k still run, then the error is
+  // printed.
+  std::vector<std::pair<size_t, std::string>> requests;
+  std::string error;
   for (int i = 0; i < n; ++i) {
     std::getline(std::cin, request);
     size_t k;
     try {
       k = std::stoull(request);
     } catch (const std::out_of_range& e) {
-      std::cerr << "Overflow" << std::endl;
-      return 0;
+      error = "Overflow";
+      break;
     } catch (const std::invalid_argument& e) {
-      std::cerr << "Invalid argument" << std::endl;
-      return 0;
+      error = "Invalid argument";
+      break;
     }
     std::getline(std::cin, request);
-    e.Request(request, k);
+    requests.emplace_back(k, request);
+  }
+  e.Batch(std::move(requests), threads);
+  if (!error.empty()) {
+    std::cerr << error << std::endl;
+    return 0;
   }
-}
\ No newline at end of file
+  ReportSession(e, stats);
+}
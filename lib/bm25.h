@@ -0,0 +1,26 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+namespace ii {
+
+constexpr double bm25_k = 2;
+constexpr double bm25_b = 0.75;
+
+inline double Bm25(double tf, double df, double dl, double N, double dl_avg) {
+  return (tf * (bm25_k + 1)) /
+         (tf + bm25_k * (1 - bm25_b + bm25_b * (dl / dl_avg))) *
+         std::log2(N / df);
+}
+
+// Impacts quantize BM25 linearly to a byte. The scale comes from the largest
+// score an index of N documents can give, (k + 1) * log2(N).
+inline uint8_t QuantizeImpact(double score, double N) {
+  double max_score = (bm25_k + 1) * std::log2(std::max(N, 2.0));
+  return static_cast<uint8_t>(
+      std::min(255.0, std::max(0.0, std::round(score / max_score * 255))));
+}
+
+}  // namespace ii
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <utility>
+
+namespace ii {
+
+// How full a queue was whenever something was pushed into it.
+struct QueueStats {
+  size_t capacity = 0;
+  size_t pushes = 0;
+  size_t occupancy = 0;
+  size_t full = 0;
+
+  void Add(const QueueStats& other) {
+    capacity = std::max(capacity, other.capacity);
+    pushes += other.pushes;
+    occupancy += other.occupancy;
+    full += other.full;
+  }
+};
+
+// Blocking FIFO of bounded size between two pipeline stages. Pop() returns
+// false once the queue is closed and drained.
+template <typename T>
+class BoundedQueue {
+  std::mutex mutex_;
+  std::condition_variable not_full_;
+  std::condition_variable not_empty_;
+  std::deque<T> items_;
+  bool closed_ = false;
+  QueueStats stats_;
+
+ public:
+  BoundedQueue(size_t capacity) { stats_.capacity = capacity; }
+
+  void Push(T item) {
+    std::unique_lock lock(mutex_);
+    ++stats_.pushes;
+    stats_.occupancy += items_.size();
+    if (items_.size() >= stats_.capacity) {
+      ++stats_.full;
+      not_full_.wait(lock,
+                     [this]() { return items_.size() < stats_.capacity; });
+    }
+    items_.push_back(std::move(item));
+    not_empty_.notify_one();
+  }
+
+  bool Pop(T& item) {
+    std::unique_lock lock(mutex_);
+    not_empty_.wait(lock, [this]() { return !items_.empty() || closed_; });
+    if (items_.empty()) {
+      return false;
+    }
+    item = std::move(items_.front());
+    items_.pop_front();
+    not_full_.notify_one();
+    return true;
+  }
+
+  void Close() {
+    std::lock_guard lock(mutex_);
+    closed_ = true;
+    not_empty_.notify_all();
+  }
+
+  QueueStats Stats() {
+    std::lock_guard lock(mutex_);
+    return stats_;
+  }
+};
+
+}  // namespace ii
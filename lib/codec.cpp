@@ -0,0 +1,380 @@
+#include "codec.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include "varint.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define II_X86 1
+#endif
+
+namespace {
+
+struct StreamVByteTables {
+  uint8_t lengths[256];
+  uint8_t shuffles[256][16];
+
+  StreamVByteTables() {
+    for (int control = 0; control < 256; ++control) {
+      uint8_t offset = 0;
+      for (int i = 0; i < 4; ++i) {
+        uint8_t length = ((control >> (2 * i)) & 3) + 1;
+        for (int j = 0; j < 4; ++j) {
+          shuffles[control][4 * i + j] = j < length ? offset + j : 0xFF;
+        }
+        offset += length;
+      }
+      lengths[control] = offset;
+    }
+  }
+};
+
+const StreamVByteTables tables;
+
+const uint8_t* DecodeScalar(const uint8_t* control, const uint8_t* data,
+                            size_t begin, size_t n, uint32_t* out) {
+  for (size_t i = begin; i < n; ++i) {
+    size_t length = ((control[i / 4] >> (2 * (i % 4))) & 3) + 1;
+    uint32_t value = 0;
+    for (size_t j = 0; j < length; ++j) {
+      value |= static_cast<uint32_t>(data[j]) << (8 * j);
+    }
+    out[i] = value;
+    data += length;
+  }
+  return data;
+}
+
+#ifdef II_X86
+__attribute__((target("ssse3"))) size_t DecodeSSSE3(const uint8_t* control,
+                                                     const uint8_t*& data,
+                                                     const uint8_t* end,
+                                                     size_t n, uint32_t* out) {
+  size_t i = 0;
+  for (; i + 4 <= n && end - data >= 16; i += 4) {
+    uint8_t c = control[i / 4];
+    __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data));
+    __m128i shuffle = _mm_loadu_si128(
+        reinterpret_cast<const __m128i*>(tables.shuffles[c]));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i),
+                     _mm_shuffle_epi8(bytes, shuffle));
+    data += tables.lengths[c];
+  }
+  return i;
+}
+
+__attribute__((target("avx2"))) size_t DecodeAVX2(const uint8_t* control,
+                                                  const uint8_t*& data,
+                                                  const uint8_t* end,
+                                                  size_t n, uint32_t* out) {
+  size_t i = 0;
+  for (; i + 8 <= n && end - data >= 32; i += 8) {
+    uint8_t c0 = control[i / 4];
+    uint8_t c1 = control[i / 4 + 1];
+    const uint8_t* next = data + tables.lengths[c0];
+    __m256i bytes = _mm256_inserti128_si256(
+        _mm256_castsi128_si256(
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(data))),
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(next)), 1);
+    __m256i shuffle = _mm256_inserti128_si256(
+        _mm256_castsi128_si256(_mm_loadu_si128(
+            reinterpret_cast<const __m128i*>(tables.shuffles[c0]))),
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(tables.shuffles[c1])),
+        1);
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i),
+                        _mm256_shuffle_epi8(bytes, shuffle));
+    data = next + tables.lengths[c1];
+  }
+  return i;
+}
+
+const bool has_avx2 = __builtin_cpu_supports("avx2");
+const bool has_ssse3 = __builtin_cpu_supports("ssse3");
+#endif
+
+}  // namespace
+
+bool ii::ParseCodec(const std::string& name, Codec& codec) {
+  if (name == "varint") {
+    codec = Codec::Varint;
+  } else if (name == "streamvbyte") {
+    codec = Codec::StreamVByte;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+void ii::EncodeStreamVByte(const uint32_t* values, size_t n,
+                           std::vector<uint8_t>& out) {
+  size_t control = out.size();
+  out.resize(out.size() + (n + 3) / 4, 0);
+  for (size_t i = 0; i < n; ++i) {
+    uint32_t value = values[i];
+    size_t length = 1;
+    while (length < 4 && (value >> (8 * length)) != 0) {
+      ++length;
+    }
+    out[control + i / 4] |= (length - 1) << (2 * (i % 4));
+    for (size_t j = 0; j < length; ++j) {
+      out.push_back(static_cast<uint8_t>(value >> (8 * j)));
+    }
+  }
+}
+
+const uint8_t* ii::DecodeStreamVByte(const uint8_t* in, const uint8_t* end,
+                                     size_t n, uint32_t* out) {
+  const uint8_t* control = in;
+  const uint8_t* data = in + (n + 3) / 4;
+  size_t i = 0;
+#ifdef II_X86
+  if (has_avx2) {
+    i = DecodeAVX2(control, data, end, n, out);
+  }
+  if (has_ssse3) {
+    i += DecodeSSSE3(control + i / 4, data, end, n - i, out + i);
+  }
+#endif
+  return DecodeScalar(control, data, i, n, out);
+}
+
+ii::BlockEncoder::BlockEncoder(Codec codec, std::ostream& file)
+    : codec_(codec), file_(file) {
+  block_.reserve(block_size);
+}
+
+void ii::BlockEncoder::Add(size_t value) {
+  if (codec_ == Codec::Varint) {
+    WriteVarint(file_, value);
+    return;
+  }
+  block_.push_back(static_cast<uint32_t>(value));
+  if (block_.size() == block_size) {
+    Flush();
+  }
+}
+
+void ii::BlockEncoder::Flush() {
+  if (block_.empty()) {
+    return;
+  }
+  std::vector<uint8_t> bytes;
+  EncodeStreamVByte(block_.data(), block_.size(), bytes);
+  WriteVarint(file_, block_.size());
+  file_.write(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+  block_.clear();
+}
+
+void ii::BlockDecoder::Fill(Cursor& cursor) {
+  size_ = std::min(cursor.ReadVarint(), BlockEncoder::block_size);
+  pos_ = 0;
+  const uint8_t* next =
+      DecodeStreamVByte(cursor.Data(), cursor.End(), size_, values_.data());
+  cursor.Skip(next - cursor.Data());
+}
+
+ii::PostingWriter::PostingWriter(Codec codec, std::ostream& posting_table,
+                                 std::ostream& position_table,
+                                 ImpactFunction impact)
+    : posting_table_(posting_table),
+      position_table_(position_table),
+      gaps_(codec, postings_),
+      tfs_(codec, postings_),
+      positions_(codec, position_table),
+      impact_(std::move(impact)),
+      position_start_(position_table.tellp()) {
+  skips_.push_back(SkipEntry{0, 0, 0});
+}
+
+void ii::PostingWriter::Add(size_t DID, size_t dl,
+                            const std::vector<size_t>& positions) {
+  if (count_ != 0 && count_ % BlockEncoder::block_size == 0) {
+    positions_.Flush();
+    skips_.push_back(SkipEntry{
+        prev_DID_, static_cast<size_t>(postings_.tellp()),
+        static_cast<size_t>(position_table_.tellp()) - position_start_});
+  }
+  SkipEntry& block = skips_.back();
+  block.max_tf = std::max(block.max_tf, positions.size());
+  block.min_dl = count_ % BlockEncoder::block_size == 0
+                     ? dl
+                     : std::min(block.min_dl, dl);
+  if (impact_) {
+    stats_.emplace_back(positions.size(), dl);
+  }
+  ++count_;
+  gaps_.Add(DID - prev_DID_);
+  tfs_.Add(positions.size());
+  prev_DID_ = DID;
+  size_t prev_position = 0;
+  for (size_t position : positions) {
+    positions_.Add(position - prev_position);
+    prev_position = position;
+  }
+}
+
+void ii::PostingWriter::Finish() {
+  gaps_.Flush();
+  tfs_.Flush();
+  positions_.Flush();
+  std::string impacts;
+  if (impact_) {
+    for (size_t i = 0; i < stats_.size(); ++i) {
+      uint8_t impact = impact_(stats_[i].first, stats_[i].second, count_);
+      impacts.push_back(impact);
+      SkipEntry& block = skips_[i / BlockEncoder::block_size];
+      block.max_impact = std::max<size_t>(block.max_impact, impact);
+    }
+  }
+  if (skips_.size() > 1) {
+    std::ostringstream skips;
+    WriteVarint(skips, skips_[0].max_tf);
+    WriteVarint(skips, skips_[0].min_dl);
+    if (impact_) {
+      WriteVarint(skips, skips_[0].max_impact);
+    }
+    for (size_t i = 1; i < skips_.size(); ++i) {
+      WriteVarint(skips, skips_[i].DID - skips_[i - 1].DID);
+      WriteVarint(skips,
+                  skips_[i].posting_offset - skips_[i - 1].posting_offset);
+      WriteVarint(skips,
+                  skips_[i].position_offset - skips_[i - 1].position_offset);
+      WriteVarint(skips, skips_[i].max_tf);
+      WriteVarint(skips, skips_[i].min_dl);
+      if (impact_) {
+        WriteVarint(skips, skips_[i].max_impact);
+      }
+    }
+    WriteVarint(posting_table_, static_cast<size_t>(skips.tellp()));
+    posting_table_ << skips.str();
+  }
+  posting_table_ << impacts << postings_.str();
+  postings_.str("");
+  stats_.clear();
+  skips_.assign(1, SkipEntry{0, 0, 0});
+  prev_DID_ = 0;
+  count_ = 0;
+  position_start_ = position_table_.tellp();
+}
+
+ii::PostingReader::PostingReader(Codec codec, Cursor cursor, size_t df,
+                                 bool impacts)
+    : cursor_(cursor), gaps_(codec), tfs_(codec), left_(df) {
+  if (df > BlockEncoder::block_size) {
+    cursor_.Skip(cursor_.ReadVarint());
+  }
+  if (impacts) {
+    cursor_.Skip(df);
+  }
+}
+
+ii::PostingCursor::PostingCursor(Codec codec, Cursor cursor, size_t df,
+                                 bool impacts)
+    : codec_(codec), gaps_(codec), tfs_(codec), df_(df) {
+  skips_.push_back(SkipEntry{0, 0, 0});
+  if (df > BlockEncoder::block_size) {
+    const uint8_t* start = cursor.Data();
+    size_t bytes = cursor.ReadVarint();
+    Cursor skips(cursor.Data(), cursor.Data() + bytes);
+    cursor.Skip(bytes);
+    skips_[0].max_tf = skips.ReadVarint();
+    skips_[0].min_dl = skips.ReadVarint();
+    if (impacts) {
+      skips_[0].max_impact = skips.ReadVarint();
+    }
+    while (!skips.AtEnd()) {
+      SkipEntry skip = skips_.back();
+      skip.DID += skips.ReadVarint();
+      skip.posting_offset += skips.ReadVarint();
+      skip.position_offset += skips.ReadVarint();
+      skip.max_tf = skips.ReadVarint();
+      skip.min_dl = skips.ReadVarint();
+      if (impacts) {
+        skip.max_impact = skips.ReadVarint();
+      }
+      skips_.push_back(skip);
+    }
+    read_counters.posting_bytes += cursor.Data() - start;
+  } else if (impacts) {
+    skips_[0].max_impact = *std::max_element(cursor.Data(), cursor.Data() + df);
+  }
+  if (impacts) {
+    impacts_ = cursor.Data();
+    cursor.Skip(df);
+  }
+  data_ = cursor;
+  cursor_ = cursor;
+  Next();
+}
+
+void ii::PostingCursor::Seek(size_t block) {
+  cursor_ = data_;
+  cursor_.Skip(skips_[block].posting_offset);
+  gaps_.Reset();
+  tfs_.Reset();
+  i_ = block * BlockEncoder::block_size;
+  DID_ = skips_[block].DID;
+  tf_ = 0;
+  block_tf_ = 0;
+}
+
+bool ii::PostingCursor::Next() {
+  if (i_ == df_) {
+    end_ = true;
+    return false;
+  }
+  block_tf_ = i_ % BlockEncoder::block_size == 0 ? 0 : block_tf_ + tf_;
+  const uint8_t* data = cursor_.Data();
+  DID_ += gaps_.Next(cursor_);
+  tf_ = tfs_.Next(cursor_);
+  read_counters.posting_bytes += cursor_.Data() - data;
+  ++read_counters.postings;
+  ++i_;
+  return true;
+}
+
+bool ii::PostingCursor::Advance(size_t target) {
+  if (end_) {
+    return false;
+  }
+  if (DID_ >= target) {
+    return true;
+  }
+  size_t block = (i_ - 1) / BlockEncoder::block_size;
+  size_t step = 1;
+  while (block + step < skips_.size() && skips_[block + step].DID < target) {
+    block += step;
+    step *= 2;
+  }
+  for (; step > 0; step /= 2) {
+    if (block + step < skips_.size() && skips_[block + step].DID < target) {
+      block += step;
+    }
+  }
+  if (block > (i_ - 1) / BlockEncoder::block_size) {
+    Seek(block);
+  }
+  while (Next()) {
+    if (DID_ >= target) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void ii::PostingCursor::Positions(Cursor position,
+                                  std::vector<size_t>& positions) const {
+  position.Skip(skips_[(i_ - 1) / BlockEncoder::block_size].position_offset);
+  PositionReader reader(codec_, position);
+  for (size_t j = 0; j < block_tf_; ++j) {
+    reader.Next();
+  }
+  size_t value = 0;
+  for (size_t j = 0; j < tf_; ++j) {
+    value += reader.Next();
+    positions.push_back(value);
+  }
+  read_counters.position_bytes += reader.Data() - position.Data();
+}
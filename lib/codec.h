@@ -0,0 +1,199 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <functional>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "mapped_file.h"
+#include "read_counters.h"
+
+namespace ii {
+
+enum class Codec : uint8_t { Varint = 0, StreamVByte = 1 };
+
+bool ParseCodec(const std::string& name, Codec& codec);
+
+// Posting and position lists are streams of small integers cut into blocks of
+// block_size values. Codec::Varint keeps one varint per value. With
+// Codec::StreamVByte a block is a varint count followed by the Stream VByte
+// layout: two-bit byte lengths of all values first, then the value bytes, so
+// a shuffle decodes four (SSSE3) or eight (AVX2) values at once.
+class BlockEncoder {
+  Codec codec_;
+  std::ostream& file_;
+  std::vector<uint32_t> block_;
+
+ public:
+  static constexpr size_t block_size = 128;
+
+  BlockEncoder(Codec codec, std::ostream& file);
+
+  void Add(size_t value);
+
+  void Flush();
+};
+
+class BlockDecoder {
+  Codec codec_;
+  std::array<uint32_t, BlockEncoder::block_size> values_;
+  size_t pos_ = 0;
+  size_t size_ = 0;
+
+  void Fill(Cursor& cursor);
+
+ public:
+  BlockDecoder(Codec codec) : codec_(codec) {}
+
+  void Reset() { pos_ = size_ = 0; }
+
+  size_t Next(Cursor& cursor) {
+    if (codec_ == Codec::Varint) {
+      return cursor.ReadVarint();
+    }
+    if (pos_ == size_) {
+      Fill(cursor);
+    }
+    return values_[pos_++];
+  }
+};
+
+// Encodes and decodes n values in Stream VByte layout, picking the widest
+// shuffle the CPU supports.
+void EncodeStreamVByte(const uint32_t* values, size_t n,
+                       std::vector<uint8_t>& out);
+
+const uint8_t* DecodeStreamVByte(const uint8_t* in, const uint8_t* end,
+                                 size_t n, uint32_t* out);
+
+// Posting lists longer than one block start with skip data: the varint byte
+// length of the skip entries, the largest tf and the smallest document length
+// of the first block, then for every further block the last DID before it,
+// the offsets of its postings and positions, delta coded, and its tf and
+// length extremes. Those bound the BM25 score of any posting in the block.
+// Position blocks are cut at the same postings, so every skip lands on a
+// block boundary in both tables.
+//
+// Indexes with impacts add the largest impact of each block to its entry and
+// put one precomputed impact byte per posting between skip data and postings.
+struct SkipEntry {
+  size_t DID;
+  size_t posting_offset;
+  size_t position_offset;
+  size_t max_tf = 0;
+  size_t min_dl = 0;
+  size_t max_impact = 0;
+};
+
+// Quantized score of a posting from its tf, document length and the df of
+// its term.
+using ImpactFunction = std::function<uint8_t(size_t tf, size_t dl, size_t df)>;
+
+class PostingWriter {
+  std::ostream& posting_table_;
+  std::ostream& position_table_;
+  std::ostringstream postings_;
+  BlockEncoder gaps_;
+  BlockEncoder tfs_;
+  BlockEncoder positions_;
+  std::vector<SkipEntry> skips_;
+  ImpactFunction impact_;
+  std::vector<std::pair<size_t, size_t>> stats_;
+  size_t prev_DID_ = 0;
+  size_t count_ = 0;
+  size_t position_start_;
+
+ public:
+  PostingWriter(Codec codec, std::ostream& posting_table,
+                std::ostream& position_table, ImpactFunction impact = {});
+
+  void Add(size_t DID, size_t dl, const std::vector<size_t>& positions);
+
+  void Finish();
+};
+
+class PostingReader {
+  Cursor cursor_;
+  BlockDecoder gaps_;
+  BlockDecoder tfs_;
+  size_t left_;
+  size_t DID_ = 0;
+
+ public:
+  PostingReader(Codec codec, Cursor cursor, size_t df, bool impacts = false);
+
+  bool Next(size_t& DID, size_t& tf) {
+    if (left_ == 0) {
+      return false;
+    }
+    --left_;
+    DID_ += gaps_.Next(cursor_);
+    DID = DID_;
+    tf = tfs_.Next(cursor_);
+    return true;
+  }
+};
+
+// Random access to one posting list. Advance() gallops over the skip entries
+// and decodes only the block that can hold the target.
+class PostingCursor {
+  Codec codec_;
+  Cursor data_;
+  Cursor cursor_;
+  BlockDecoder gaps_;
+  BlockDecoder tfs_;
+  std::vector<SkipEntry> skips_;
+  const uint8_t* impacts_ = nullptr;
+  size_t df_;
+  size_t i_ = 0;
+  size_t DID_ = 0;
+  size_t tf_ = 0;
+  size_t block_tf_ = 0;
+  bool end_ = false;
+
+  void Seek(size_t block);
+
+ public:
+  PostingCursor(Codec codec, Cursor cursor, size_t df, bool impacts = false);
+
+  bool AtEnd() const { return end_; }
+
+  size_t DID() const { return DID_; }
+
+  size_t Tf() const { return tf_; }
+
+  size_t Df() const { return df_; }
+
+  uint8_t Impact() const { return impacts_[i_ - 1]; }
+
+  // Skip entry of every block. The tf and length extremes stay zero when the
+  // list is too short to carry skip data, the impact maximum is always set
+  // when the index has impacts.
+  const std::vector<SkipEntry>& Skips() const { return skips_; }
+
+  bool Next();
+
+  bool Advance(size_t target);
+
+  // Appends the token positions of the current posting, given the position
+  // list of the term.
+  void Positions(Cursor position, std::vector<size_t>& positions) const;
+};
+
+class PositionReader {
+  Cursor cursor_;
+  BlockDecoder values_;
+
+ public:
+  PositionReader(Codec codec, Cursor cursor)
+      : cursor_(cursor), values_(codec) {}
+
+  size_t Next() { return values_.Next(cursor_); }
+
+  const uint8_t* Data() const { return cursor_.Data(); }
+};
+
+}  // namespace ii
@@ -0,0 +1,50 @@
+#include "crawler.h"
+
+#include <algorithm>
+#include <utility>
+
+ii::Crawler::Crawler(const std::filesystem::path& root) { Push(root); }
+
+void ii::Crawler::Push(const std::filesystem::path& directory) {
+  std::vector<std::pair<std::string, std::filesystem::directory_entry>> keyed;
+  for (const auto& entry : std::filesystem::directory_iterator(directory)) {
+    std::string key = entry.path().filename().string();
+    if (entry.is_directory()) {
+      key += '/';
+    }
+    keyed.emplace_back(std::move(key), entry);
+  }
+  std::sort(keyed.begin(), keyed.end(), [](const auto& lhs, const auto& rhs) {
+    return lhs.first > rhs.first;
+  });
+  std::vector<std::filesystem::directory_entry> entries;
+  entries.reserve(keyed.size());
+  for (auto& [key, entry] : keyed) {
+    entries.push_back(std::move(entry));
+  }
+  stack_.push_back(std::move(entries));
+}
+
+bool ii::Crawler::Next(DocFile& file) {
+  while (!stack_.empty()) {
+    if (stack_.back().empty()) {
+      stack_.pop_back();
+      continue;
+    }
+    std::filesystem::directory_entry entry = std::move(stack_.back().back());
+    stack_.back().pop_back();
+    if (entry.is_directory()) {
+      if (!entry.is_symlink()) {
+        Push(entry.path());
+      }
+      continue;
+    }
+    file = DocFile{
+        entry.path().string(),
+        static_cast<uint64_t>(
+            entry.last_write_time().time_since_epoch().count()),
+        entry.file_size()};
+    return true;
+  }
+  return false;
+}
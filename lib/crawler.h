@@ -0,0 +1,32 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+namespace ii {
+
+struct DocFile {
+  std::string path;
+  uint64_t mtime;
+  uint64_t size;
+};
+
+// Walks a directory tree a directory at a time, so files can be indexed
+// while the rest of the tree is still listed. Siblings are visited by name,
+// with a '/' appended to directories, which yields the files in the order of
+// their sorted paths. Links to directories are not followed.
+class Crawler {
+  // Unvisited entries of every open directory, the next one last.
+  std::vector<std::vector<std::filesystem::directory_entry>> stack_;
+
+  void Push(const std::filesystem::path& directory);
+
+ public:
+  Crawler(const std::filesystem::path& root);
+
+  bool Next(DocFile& file);
+};
+
+}  // namespace ii
@@ -0,0 +1,131 @@
+#include "dictionary.h"
+
+#include <algorithm>
+
+#include "read_counters.h"
+
+ii::DictionaryWriter::DictionaryWriter(const std::string& term_info_path,
+                                       const std::string& term_index_path)
+    : term_info_(term_info_path, std::ios::binary),
+      term_index_path_(term_index_path) {}
+
+void ii::DictionaryWriter::Add(const TermEntry& entry) {
+  size_t prefix = 0;
+  if (count_ % block_size == 0) {
+    index_.emplace_back(entry.term, term_info_.tellp());
+    prev_posting_ind_ = 0;
+    prev_position_ind_ = 0;
+  } else {
+    size_t max_prefix = std::min(prev_term_.size(), entry.term.size());
+    while (prefix < max_prefix && prev_term_[prefix] == entry.term[prefix]) {
+      ++prefix;
+    }
+  }
+  WriteVarint(term_info_, prefix);
+  WriteVarint(term_info_, entry.term.size() - prefix);
+  term_info_.write(entry.term.data() + prefix, entry.term.size() - prefix);
+  WriteVarint(term_info_, entry.df);
+  WriteVarint(term_info_, entry.posting_ind - prev_posting_ind_);
+  WriteVarint(term_info_, entry.position_ind - prev_position_ind_);
+  prev_term_ = entry.term;
+  prev_posting_ind_ = entry.posting_ind;
+  prev_position_ind_ = entry.position_ind;
+  ++count_;
+}
+
+void ii::DictionaryWriter::Close() {
+  term_info_.close();
+  std::ofstream term_index(term_index_path_, std::ios::binary);
+  WriteVarint(term_index, count_);
+  size_t prev_offset = 0;
+  for (const auto& [term, offset] : index_) {
+    WriteVarint(term_index, term.size());
+    term_index << term;
+    WriteVarint(term_index, offset - prev_offset);
+    prev_offset = offset;
+  }
+}
+
+bool ii::Dictionary::Open(const std::string& term_info_path,
+                          const std::string& term_index_path) {
+  index_.clear();
+  count_ = 0;
+  MappedFile term_index;
+  if (!term_index.Open(term_index_path, MappedFile::Access::Sequential) ||
+      !term_info_.Open(term_info_path, MappedFile::Access::Random)) {
+    return false;
+  }
+  Cursor cursor = term_index.At(0);
+  count_ = cursor.ReadVarint();
+  size_t offset = 0;
+  for (size_t i = 0; i < count_; i += DictionaryWriter::block_size) {
+    std::string_view term = cursor.ReadBytes(cursor.ReadVarint());
+    offset += cursor.ReadVarint();
+    index_.emplace_back(term, offset);
+  }
+  return true;
+}
+
+bool ii::Dictionary::Find(const std::string& term, TermEntry& entry) const {
+  auto it = std::upper_bound(
+      index_.begin(), index_.end(), term,
+      [](const std::string& term, const std::pair<std::string, size_t>& block) {
+        return term < block.first;
+      });
+  if (it == index_.begin()) {
+    return false;
+  }
+  --it;
+  size_t block = it - index_.begin();
+  size_t block_count =
+      std::min(DictionaryWriter::block_size,
+               count_ - block * DictionaryWriter::block_size);
+  Cursor cursor = term_info_.At(it->second);
+  const uint8_t* start = cursor.Data();
+  entry.term.clear();
+  entry.posting_ind = 0;
+  entry.position_ind = 0;
+  bool found = false;
+  for (size_t i = 0; i < block_count; ++i) {
+    size_t prefix = cursor.ReadVarint();
+    entry.term.resize(prefix);
+    entry.term += cursor.ReadBytes(cursor.ReadVarint());
+    entry.df = cursor.ReadVarint();
+    entry.posting_ind += cursor.ReadVarint();
+    entry.position_ind += cursor.ReadVarint();
+    if (entry.term >= term) {
+      found = entry.term == term;
+      break;
+    }
+  }
+  read_counters.term_bytes += cursor.Data() - start;
+  return found;
+}
+
+ii::DictionaryIterator ii::Dictionary::Iterate() const {
+  return DictionaryIterator(term_info_.At(0), count_);
+}
+
+size_t ii::Dictionary::Size() const { return count_; }
+
+ii::DictionaryIterator::DictionaryIterator(Cursor cursor, size_t count)
+    : cursor_(cursor), count_(count) {}
+
+bool ii::DictionaryIterator::Next(TermEntry& entry) {
+  if (i_ == count_) {
+    return false;
+  }
+  if (i_ % DictionaryWriter::block_size == 0) {
+    entry_.posting_ind = 0;
+    entry_.position_ind = 0;
+  }
+  size_t prefix = cursor_.ReadVarint();
+  entry_.term.resize(prefix);
+  entry_.term += cursor_.ReadBytes(cursor_.ReadVarint());
+  entry_.df = cursor_.ReadVarint();
+  entry_.posting_ind += cursor_.ReadVarint();
+  entry_.position_ind += cursor_.ReadVarint();
+  entry = entry_;
+  ++i_;
+  return true;
+}
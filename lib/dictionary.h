@@ -0,0 +1,74 @@
+#pragma once
+
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "mapped_file.h"
+#include "varint.h"
+
+namespace ii {
+
+struct TermEntry {
+  std::string term;
+  size_t df;
+  size_t posting_ind;
+  size_t position_ind;
+};
+
+// term.bin is split into blocks of block_size entries. Inside a block every
+// term is front-coded against the previous one and the offsets are stored as
+// deltas, the first entry of a block is stored in full. term_index.bin keeps
+// the first term and the offset of every block and is small enough to be
+// loaded into memory, so a lookup decodes a single block.
+class DictionaryWriter {
+  std::ofstream term_info_;
+
+  std::vector<std::pair<std::string, size_t>> index_;
+  std::string prev_term_;
+  size_t prev_posting_ind_ = 0;
+  size_t prev_position_ind_ = 0;
+  size_t count_ = 0;
+
+  std::string term_index_path_;
+
+ public:
+  static constexpr size_t block_size = 64;
+
+  DictionaryWriter(const std::string& term_info_path,
+                   const std::string& term_index_path);
+
+  void Add(const TermEntry& entry);
+
+  void Close();
+};
+
+class DictionaryIterator {
+  Cursor cursor_;
+  size_t count_;
+  size_t i_ = 0;
+  TermEntry entry_;
+
+ public:
+  DictionaryIterator(Cursor cursor, size_t count);
+
+  bool Next(TermEntry& entry);
+};
+
+class Dictionary {
+  MappedFile term_info_;
+  std::vector<std::pair<std::string, size_t>> index_;
+  size_t count_ = 0;
+
+ public:
+  bool Open(const std::string& term_info_path,
+            const std::string& term_index_path);
+
+  bool Find(const std::string& term, TermEntry& entry) const;
+
+  DictionaryIterator Iterate() const;
+
+  size_t Size() const;
+};
+
+}  // namespace ii
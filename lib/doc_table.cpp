@@ -0,0 +1,89 @@
+#include "doc_table.h"
+
+void ii::DocTable::Write(std::ostream& doc_info, size_t dl, size_t path_offset,
+                         size_t line_offset) {
+  WriteFixed64(doc_info, dl);
+  WriteFixed64(doc_info, path_offset);
+  WriteFixed64(doc_info, line_offset);
+}
+
+bool ii::DocTable::Open(const std::string& doc_info_path,
+                        const std::string& doc_path_path,
+                        const std::string& doc_line_path,
+                        const DocExtent& extent) {
+  if (!doc_info_.Open(doc_info_path, MappedFile::Access::Random) ||
+      !doc_path_.Open(doc_path_path, MappedFile::Access::Random) ||
+      !doc_line_.Open(doc_line_path, MappedFile::Access::Random)) {
+    return false;
+  }
+  extent_ = extent;
+  if (extent_.size == SIZE_MAX) {
+    extent_.size = doc_info_.Size() / record_size;
+  }
+  if (extent_.path_bytes == SIZE_MAX) {
+    extent_.path_bytes = doc_path_.Size();
+  }
+  if (extent_.line_bytes == SIZE_MAX) {
+    extent_.line_bytes = doc_line_.Size();
+  }
+  if (extent_.size > doc_info_.Size() / record_size ||
+      extent_.path_bytes > doc_path_.Size() ||
+      extent_.line_bytes > doc_line_.Size()) {
+    Close();
+    return false;
+  }
+  return true;
+}
+
+void ii::DocTable::Close() {
+  doc_info_.Close();
+  doc_path_.Close();
+  doc_line_.Close();
+  extent_ = DocExtent();
+}
+
+size_t ii::DocTable::Size() const { return extent_.size; }
+
+const ii::DocExtent& ii::DocTable::Bounds() const { return extent_; }
+
+size_t ii::DocTable::Length(size_t DID) const {
+  return LoadFixed64(doc_info_.Data() + DID * record_size);
+}
+
+size_t ii::DocTable::Offset(size_t DID, size_t field) const {
+  if (DID == Size()) {
+    return field == 1 ? extent_.path_bytes : extent_.line_bytes;
+  }
+  return LoadFixed64(doc_info_.Data() + DID * record_size +
+                     field * sizeof(uint64_t));
+}
+
+std::string_view ii::DocTable::Path(size_t DID) const {
+  size_t begin = Offset(DID, 1);
+  size_t end = Offset(DID + 1, 1);
+  return std::string_view(
+      reinterpret_cast<const char*>(doc_path_.Data()) + begin, end - begin);
+}
+
+std::string_view ii::DocTable::LineTable(size_t DID) const {
+  size_t begin = Offset(DID, 2);
+  size_t end = Offset(DID + 1, 2);
+  return std::string_view(
+      reinterpret_cast<const char*>(doc_line_.Data()) + begin, end - begin);
+}
+
+std::vector<size_t> ii::DocTable::Lines(
+    size_t DID, const std::vector<size_t>& positions) const {
+  std::vector<size_t> lines;
+  Cursor cursor = doc_line_.Range(Offset(DID, 2), Offset(DID + 1, 2));
+  size_t line = 0;
+  size_t line_end = 0;
+  for (size_t position : positions) {
+    while (position >= line_end && !cursor.AtEnd()) {
+      line += cursor.ReadVarint();
+      line_end += cursor.ReadVarint();
+    }
+    lines.push_back(line);
+  }
+  return lines;
+}
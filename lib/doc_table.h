@@ -0,0 +1,68 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "mapped_file.h"
+#include "varint.h"
+
+namespace ii {
+
+// doc.bin is a fixed-width array indexed by DID. Every record holds the
+// document length, the offset of its path in doc_path.bin and the offset of
+// its line table in doc_line.bin, all as little-endian 64-bit numbers. Paths
+// and line tables are packed one after another.
+//
+// Postings store the token positions of a term, the line table maps them back
+// to lines: for every line holding tokens, the varint distance from the
+// previous such line and the number of its tokens.
+//
+// Updates append to the tables in place, so the index metadata keeps their
+// extent and a reader opened with it does not see records appended later.
+struct DocExtent {
+  size_t size = SIZE_MAX;
+  size_t path_bytes = SIZE_MAX;
+  size_t line_bytes = SIZE_MAX;
+};
+
+class DocTable {
+  MappedFile doc_info_;
+  MappedFile doc_path_;
+  MappedFile doc_line_;
+  DocExtent extent_;
+
+  size_t Offset(size_t DID, size_t field) const;
+
+ public:
+  static constexpr size_t record_size = 3 * sizeof(uint64_t);
+
+  static void Write(std::ostream& doc_info, size_t dl, size_t path_offset,
+                    size_t line_offset);
+
+  // The default extent takes the whole files. Fails when the files are
+  // shorter than the extent.
+  bool Open(const std::string& doc_info_path, const std::string& doc_path_path,
+            const std::string& doc_line_path, const DocExtent& extent = {});
+
+  void Close();
+
+  size_t Size() const;
+
+  const DocExtent& Bounds() const;
+
+  size_t Length(size_t DID) const;
+
+  std::string_view Path(size_t DID) const;
+
+  std::string_view LineTable(size_t DID) const;
+
+  // Lines of ascending token positions of a document.
+  std::vector<size_t> Lines(size_t DID,
+                            const std::vector<size_t>& positions) const;
+};
+
+}  // namespace ii
@@ -1,24 +1,324 @@
 #include "index.h"
 
-size_t ii::InvertedIndex::Size() const {
-  size_t terms_size = terms_.size() * sizeof(std::pair<std::string, size_t>);
-  size_t posting_table_size = 0;
-  for (int i = 0; i < posting_table_.size(); ++i) {
-    posting_table_size +=
-        posting_table_[i].size() * sizeof(std::pair<size_t, size_t>);
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace {
+
+// Reads a whole file with large reads, telling the kernel to read ahead.
+void ReadFile(const std::string& path, std::string& text) {
+  text.clear();
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd == -1) {
+    return;
+  }
+  struct stat st;
+  if (fstat(fd, &st) == 0) {
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    text.resize(st.st_size);
+    size_t done = 0;
+    while (done < text.size()) {
+      ssize_t n = read(fd, text.data() + done, text.size() - done);
+      if (n <= 0) {
+        break;
+      }
+      done += n;
+    }
+    text.resize(done);
+  }
+  close(fd);
+}
+
+double Seconds(std::chrono::steady_clock::time_point start,
+               std::chrono::steady_clock::time_point end) {
+  return std::chrono::duration<double>(end - start).count();
+}
+
+}  // namespace
+
+ii::Segment::Segment(const std::string& run_path, const size_t memory_budget)
+    : term_run_path_(run_path + "term.run"),
+      posting_run_path_(run_path + "posting_table.run"),
+      position_run_path_(run_path + "position_table.run"),
+      memory_budget_(memory_budget) {
+  std::ofstream term_run(term_run_path_);
+  std::ofstream posting_run(posting_run_path_);
+  std::ofstream position_run(position_run_path_);
+}
+
+size_t ii::Segment::Allocation(const size_t bytes) {
+  if (bytes == 0) {
+    return 0;
+  }
+  return (bytes + sizeof(size_t) + 15) / 16 * 16;
+}
+
+size_t ii::Segment::Size() const { return memory_; }
+
+bool ii::Segment::Full() const { return memory_ >= memory_budget_; }
+
+uint8_t* ii::Arena::Allocate(const size_t size) {
+  if (size > static_cast<size_t>(end_ - ptr_)) {
+    // Large requests get a block of their own, so the current one keeps
+    // serving small ones.
+    size_t block = size > block_size / 4 ? size : block_size;
+    blocks_.emplace_back(new uint8_t[block]);
+    bytes_ += block;
+    if (block != block_size) {
+      return blocks_.back().get();
+    }
+    ptr_ = blocks_.back().get();
+    end_ = ptr_ + block_size;
+  }
+  uint8_t* result = ptr_;
+  ptr_ += size;
+  return result;
+}
+
+void ii::Arena::Clear() {
+  blocks_.clear();
+  blocks_.shrink_to_fit();
+  ptr_ = nullptr;
+  end_ = nullptr;
+  bytes_ = 0;
+}
+
+size_t ii::Segment::SliceSize(const uint32_t level) {
+  return size_t{16} << std::min<size_t>(level, slice_levels - 1);
+}
+
+void ii::Segment::Grow() {
+  slots_.assign(std::max<size_t>(1024, slots_.size() * 2), empty_slot);
+  size_t mask = slots_.size() - 1;
+  for (uint32_t index = 0; index < terms_.size(); ++index) {
+    size_t i = terms_[index].hash & mask;
+    while (slots_[i] != empty_slot) {
+      i = (i + 1) & mask;
+    }
+    slots_[i] = index;
+  }
+}
+
+ii::Segment::Term& ii::Segment::Find(std::string_view term) {
+  if ((terms_.size() + 1) * 2 > slots_.size()) {
+    Grow();
+  }
+  size_t hash = std::hash<std::string_view>{}(term);
+  size_t mask = slots_.size() - 1;
+  for (size_t i = hash & mask;; i = (i + 1) & mask) {
+    if (slots_[i] == empty_slot) {
+      uint8_t* text = arena_.Allocate(term.size());
+      std::memcpy(text, term.data(), term.size());
+      uint8_t* head = arena_.Allocate(SliceSize(0));
+      uint8_t* next = nullptr;
+      std::memcpy(head, &next, sizeof next);
+      slots_[i] = terms_.size();
+      terms_.push_back(Term{text, static_cast<uint32_t>(term.size()), 0, hash,
+                            head, head, head + sizeof(uint8_t*),
+                            head + SliceSize(0), 0, 0, 0});
+      return terms_.back();
+    }
+    Term& candidate = terms_[slots_[i]];
+    if (candidate.hash == hash && candidate.size == term.size() &&
+        std::memcmp(candidate.text, term.data(), term.size()) == 0) {
+      return candidate;
+    }
+  }
+}
+
+void ii::Segment::Append(Term& term, size_t value) {
+  while (true) {
+    if (term.ptr == term.end) {
+      uint8_t* slice = arena_.Allocate(SliceSize(++term.level));
+      uint8_t* next = nullptr;
+      std::memcpy(slice, &next, sizeof next);
+      std::memcpy(term.slice, &slice, sizeof slice);
+      term.slice = slice;
+      term.ptr = slice + sizeof(uint8_t*);
+      term.end = slice + SliceSize(term.level);
+    }
+    if (value < (1 << 7)) {
+      *term.ptr++ = value;
+      return;
+    }
+    *term.ptr++ = value % (1 << 7) + (1 << 7);
+    value >>= 7;
+  }
+}
+
+void ii::Segment::Add(std::string_view term, const size_t DID,
+                      const size_t position) {
+  Term& entry = Find(term);
+  if (entry.df == 0 || entry.last_DID != DID) {
+    Append(entry, DID - entry.last_DID);
+    Append(entry, position);
+    entry.last_DID = DID;
+    ++entry.df;
+  } else {
+    Append(entry, 0);
+    Append(entry, position - entry.last_position);
+  }
+  entry.last_position = position;
+  memory_ = arena_.Bytes() + Allocation(terms_.capacity() * sizeof(Term)) +
+            Allocation(slots_.capacity() * sizeof(uint32_t));
+}
+
+void ii::Segment::Clear() {
+  arena_.Clear();
+  terms_ = {};
+  slots_ = {};
+  memory_ = 0;
+}
+
+const std::vector<size_t>& ii::Segment::Runs() const { return runs_; }
+
+const std::string& ii::Segment::TermRunPath() const { return term_run_path_; }
+
+const std::string& ii::Segment::PostingRunPath() const {
+  return posting_run_path_;
+}
+
+const std::string& ii::Segment::PositionRunPath() const {
+  return position_run_path_;
+}
+
+void ii::Segment::RemoveRuns() const {
+  std::filesystem::remove(term_run_path_);
+  std::filesystem::remove(posting_run_path_);
+  std::filesystem::remove(position_run_path_);
+}
+
+void ii::Segment::Update() {
+  if (terms_.empty()) {
+    return;
+  }
+  std::ofstream term_info(term_run_path_, std::ios::binary | std::ios::app);
+  std::ofstream posting_table(posting_run_path_,
+                              std::ios::binary | std::ios::app);
+  std::ofstream position_table(position_run_path_,
+                               std::ios::binary | std::ios::app);
+  PostingWriter writer(Codec::Varint, posting_table, position_table);
+  auto text = [this](uint32_t index) {
+    return std::string_view(reinterpret_cast<const char*>(terms_[index].text),
+                            terms_[index].size);
+  };
+  std::vector<uint32_t> order(terms_.size());
+  for (uint32_t i = 0; i < order.size(); ++i) {
+    order[i] = i;
+  }
+  std::sort(order.begin(), order.end(),
+            [&text](uint32_t a, uint32_t b) { return text(a) < text(b); });
+  std::vector<uint8_t> bytes;
+  std::vector<size_t> positions;
+  for (uint32_t index : order) {
+    const Term& term = terms_[index];
+    WriteVarint(term_info, term.size);
+    term_info << text(index);
+    WriteVarint(term_info, term.df);
+    WriteVarint(term_info, posting_table.tellp());
+    WriteVarint(term_info, position_table.tellp());
+
+    bytes.clear();
+    uint8_t* slice = term.head;
+    for (uint32_t level = 0; slice != term.slice; ++level) {
+      bytes.insert(bytes.end(), slice + sizeof(uint8_t*),
+                   slice + SliceSize(level));
+      std::memcpy(&slice, slice, sizeof(uint8_t*));
+    }
+    bytes.insert(bytes.end(), slice + sizeof(uint8_t*), term.ptr);
+    // The first occurrence always opens a posting, later ones with a zero
+    // gap continue it.
+    Cursor cursor(bytes.data(), bytes.data() + bytes.size());
+    size_t DID = 0;
+    while (!cursor.AtEnd()) {
+      size_t gap = cursor.ReadVarint();
+      size_t delta = cursor.ReadVarint();
+      if (positions.empty() || gap != 0) {
+        if (!positions.empty()) {
+          writer.Add(DID, 0, positions);
+          positions.clear();
+        }
+        DID += gap;
+        positions.push_back(delta);
+      } else {
+        positions.push_back(positions.back() + delta);
+      }
+    }
+    writer.Add(DID, 0, positions);
+    positions.clear();
+    writer.Finish();
   }
-  size_t position_table_size = position_table_.size() * sizeof(size_t);
-  return terms_size + posting_table_size + position_table_size;
+  runs_.push_back(term_info.tellp());
+  term_info.close();
+  posting_table.close();
+  position_table.close();
+  Clear();
 }
 
 bool ii::InvertedIndex::Parse(int argc, char** argv) {
-  if (argc == 3 && !strcmp(argv[1], "-i")) {
-    input_directory_ = argv[2];
-    return true;
+  for (int i = 1; i < argc; ++i) {
+    if (!strcmp(argv[i], "-i") && i + 1 < argc) {
+      input_directory_ = argv[++i];
+    } else if (!strcmp(argv[i], "-j") && i + 1 < argc) {
+      char* end;
+      threads_ = std::strtoull(argv[++i], &end, 10);
+      if (*end != '\0' || threads_ == 0) {
+        return false;
+      }
+    } else if (!strcmp(argv[i], "--mem-budget") && i + 1 < argc) {
+      char* end;
+      memory_budget_ = std::strtoull(argv[++i], &end, 10);
+      if (*end == 'K' || *end == 'k') {
+        memory_budget_ <<= 10;
+        ++end;
+      } else if (*end == 'M' || *end == 'm') {
+        memory_budget_ <<= 20;
+        ++end;
+      } else if (*end == 'G' || *end == 'g') {
+        memory_budget_ <<= 30;
+        ++end;
+      }
+      if (*end != '\0' || memory_budget_ == 0) {
+        return false;
+      }
+    } else if (!strcmp(argv[i], "--codec") && i + 1 < argc) {
+      if (!ParseCodec(argv[++i], codec_)) {
+        return false;
+      }
+    } else if (!strcmp(argv[i], "--impacts")) {
+      impacts_ = true;
+    } else if (!strcmp(argv[i], "--stats")) {
+      stats_ = true;
+    } else if (!strcmp(argv[i], "--shards") && i + 1 < argc) {
+      char* end;
+      shards_ = std::strtoull(argv[++i], &end, 10);
+      if (*end != '\0' || shards_ == 0) {
+        return false;
+      }
+    } else if (!strcmp(argv[i], "-u")) {
+      update_ = true;
+    } else if (!strcmp(argv[i], "-c")) {
+      compact_ = true;
+    } else {
+      return false;
+    }
+  }
+  // Shards score with the df and N of the whole index, which impacts fixed
+  // per shard cannot follow.
+  if (shards_ > 1 && impacts_) {
+    return false;
   }
-  return false;
+  return !input_directory_.empty() || (compact_ && !update_);
 }
 
+ii::InvertedIndex::InvertedIndex(const std::string& directory)
+    : info_directory(directory) {}
+
+ii::InvertedIndex::~InvertedIndex() { Unlock(); }
+
 std::vector<uint8_t> ii::InvertedIndex::VarintEncoding(size_t n) const {
   std::vector<uint8_t> bytes;
   if (n == 0) {
@@ -35,113 +335,743 @@ std::vector<uint8_t> ii::InvertedIndex::VarintEncoding(size_t n) const {
 }
 
 void ii::InvertedIndex::Write(std::ofstream& file, const size_t n) const {
-  std::vector<uint8_t> bytes = VarintEncoding(n);
-  for (int i = 0; i < bytes.size(); ++i) {
-    file << bytes[i];
+  WriteVarint(file, n);
+}
+
+bool ii::InvertedIndex::ReadTerm(Cursor& cursor, TermEntry& run) const {
+  if (cursor.AtEnd()) {
+    return false;
   }
+  run.term = cursor.ReadBytes(cursor.ReadVarint());
+  run.df = cursor.ReadVarint();
+  run.posting_ind = cursor.ReadVarint();
+  run.position_ind = cursor.ReadVarint();
+  return true;
 }
 
-void ii::InvertedIndex::Clear() {
-  terms_.clear();
-  posting_table_.clear();
-  position_table_.clear();
+void ii::InvertedIndex::Merge(std::vector<MergeSource>& sources,
+                              const SegmentFiles& output,
+                              const std::vector<size_t>& remap,
+                              const std::vector<size_t>& lengths,
+                              const size_t first_DID) const {
+  std::vector<TermEntry> heads(sources.size());
+  std::priority_queue<std::pair<std::string, size_t>,
+                      std::vector<std::pair<std::string, size_t>>,
+                      std::greater<>>
+      queue;
+  for (size_t i = 0; i < sources.size(); ++i) {
+    if (sources[i].next(heads[i])) {
+      queue.emplace(heads[i].term, i);
+    }
+  }
+  DictionaryWriter dictionary(output.term_info_path, output.term_index_path);
+  std::ofstream posting_table(output.posting_table_path, std::ios::binary);
+  std::ofstream position_table(output.position_table_path, std::ios::binary);
+  ImpactFunction impact;
+  if (impact_N_ != 0) {
+    impact = [N = N, dl_avg = (double)dl_all / N,
+              impact_N = impact_N_](size_t tf, size_t dl, size_t df) {
+      return QuantizeImpact(Bm25(tf, df, dl, N, dl_avg), impact_N);
+    };
+  }
+  PostingWriter writer(codec_, posting_table, position_table, impact);
+  struct Reader {
+    PostingReader posting;
+    PositionReader position;
+    size_t DID = 0;
+    size_t tf = 0;
+  };
+  std::vector<Reader> readers;
+  std::priority_queue<std::pair<size_t, size_t>,
+                      std::vector<std::pair<size_t, size_t>>, std::greater<>>
+      postings;
+  while (!queue.empty()) {
+    std::string term = queue.top().first;
+    size_t posting_ind = posting_table.tellp();
+    size_t position_ind = position_table.tellp();
+    size_t df = 0;
+    size_t pending_DID = 0;
+    std::vector<size_t> pending_positions;
+    readers.clear();
+    while (!queue.empty() && queue.top().first == term) {
+      size_t source = queue.top().second;
+      queue.pop();
+      readers.push_back(Reader{
+          PostingReader(
+              sources[source].codec,
+              sources[source].posting_table->At(heads[source].posting_ind),
+              heads[source].df, sources[source].impacts),
+          PositionReader(
+              sources[source].codec,
+              sources[source].position_table->At(heads[source].position_ind))});
+      Reader& reader = readers.back();
+      if (reader.posting.Next(reader.DID, reader.tf)) {
+        postings.emplace(reader.DID, readers.size() - 1);
+      }
+      if (sources[source].next(heads[source])) {
+        queue.emplace(heads[source].term, source);
+      }
+    }
+    while (!postings.empty()) {
+      Reader& reader = readers[postings.top().second];
+      postings.pop();
+      size_t new_DID = remap.empty() ? reader.DID : remap[reader.DID];
+      if (new_DID == SIZE_MAX) {
+        for (size_t j = 0; j < reader.tf; ++j) {
+          reader.position.Next();
+        }
+      } else {
+        if (!pending_positions.empty() && new_DID != pending_DID) {
+          writer.Add(pending_DID, lengths[pending_DID - first_DID],
+                     pending_positions);
+          pending_positions.clear();
+          ++df;
+        }
+        pending_DID = new_DID;
+        size_t value = 0;
+        for (size_t j = 0; j < reader.tf; ++j) {
+          value += reader.position.Next();
+          pending_positions.push_back(value);
+        }
+      }
+      if (reader.posting.Next(reader.DID, reader.tf)) {
+        postings.emplace(reader.DID, &reader - readers.data());
+      }
+    }
+    if (!pending_positions.empty()) {
+      writer.Add(pending_DID, lengths[pending_DID - first_DID],
+                 pending_positions);
+      ++df;
+    }
+    writer.Finish();
+    if (df != 0) {
+      dictionary.Add(TermEntry{term, df, posting_ind, position_ind});
+    }
+  }
+  dictionary.Close();
 }
 
-void ii::InvertedIndex::Update() {
-  std::ofstream term_info(term_info_path, std::ios::binary | std::ios::app);
-  std::ofstream posting_table(posting_table_path,
-                              std::ios::binary | std::ios::app);
-  std::ofstream position_table(position_table_path,
-                               std::ios::binary | std::ios::app);
-  for (auto term_it = terms_.begin(); term_it != terms_.end(); ++term_it) {
-    std::string term = term_it->first;
-    size_t ind = term_it->second;
+void ii::InvertedIndex::MergeRuns(const SegmentFiles& output,
+                                  const std::vector<size_t>& lengths,
+                                  const size_t first_DID) {
+  std::vector<MappedFile> term_runs(segments_.size());
+  std::vector<MappedFile> posting_runs(segments_.size());
+  std::vector<MappedFile> position_runs(segments_.size());
+  std::vector<MergeSource> sources;
+  for (size_t i = 0; i < segments_.size(); ++i) {
+    term_runs[i].Open(segments_[i].TermRunPath());
+    posting_runs[i].Open(segments_[i].PostingRunPath());
+    position_runs[i].Open(segments_[i].PositionRunPath());
+    const std::vector<size_t>& runs = segments_[i].Runs();
+    for (size_t j = 0; j < runs.size(); ++j) {
+      Cursor cursor = term_runs[i].Range(j == 0 ? 0 : runs[j - 1], runs[j]);
+      sources.push_back(MergeSource{
+          [this, cursor](TermEntry& entry) mutable {
+            return ReadTerm(cursor, entry);
+          },
+          &posting_runs[i], &position_runs[i], Codec::Varint, false});
+    }
+  }
+  Merge(sources, output, {}, lengths, first_DID);
+  for (const auto& segment : segments_) {
+    segment.RemoveRuns();
+  }
+  segments_.clear();
+}
 
-    Write(term_info, term.size());
-    term_info << term;
-    Write(term_info, posting_table_[ind].size());
-    Write(term_info, posting_table.tellp());
-    Write(term_info, position_table.tellp());
+bool ii::NormalizeTerm(std::string& term) {
+  term.erase(std::remove_if(term.begin(), term.end(),
+                            [](char c) {
+                              return (c != '-' && c != '_' && ispunct(c));
+                            }),
+             term.end());
+  std::transform(term.begin(), term.end(), term.begin(), ::tolower);
+  return term.size() != 0 && term != "-" && term != "_";
+}
 
-    size_t prev_DID = 0;
+size_t ii::InvertedIndex::ParseDocument(std::string& text, const size_t DID,
+                                        Segment& segment,
+                                        std::string& lines) const {
+  std::ostringstream line_table;
+  Tokenizer tokenizer(text.data(), text.data() + text.size());
+  std::string_view term;
+  size_t line = 0;
+  size_t prev_line = 0;
+  size_t line_start = 0;
+  size_t dl = 0;
+  auto end_line = [&]() {
+    if (dl != line_start) {
+      WriteVarint(line_table, line - prev_line);
+      WriteVarint(line_table, dl - line_start);
+      prev_line = line;
+      line_start = dl;
+    }
+  };
+  while (tokenizer.Next(term)) {
+    if (tokenizer.Line() != line) {
+      end_line();
+      line = tokenizer.Line();
+    }
+    segment.Add(term, DID, dl);
+    ++dl;
+    if (segment.Full()) {
+      segment.Update();
+    }
+  }
+  end_line();
+  lines = line_table.str();
+  return dl;
+}
 
-    size_t position_table_ind = 0;
-    for (auto posting_it = posting_table_[ind].begin();
-         posting_it != posting_table_[ind].end(); ++posting_it) {
-      size_t DID = posting_it->first;
-      size_t tf = posting_it->second;
-      Write(posting_table, DID - prev_DID);
-      Write(posting_table, tf);
-      prev_DID = DID;
-      size_t prev_pos = 0;
-      for (int i = 0; i < tf; ++i, ++position_table_ind) {
-        Write(position_table, position_table_[ind][position_table_ind] - prev_pos);
-        prev_pos = position_table_[ind][position_table_ind];
+std::vector<size_t> ii::InvertedIndex::Index(
+    const FileSource& source, const size_t first_DID,
+    std::vector<DocFile>& files, std::vector<std::string>& line_tables) {
+  files.clear();
+  segments_.clear();
+  for (size_t i = 0; i < threads_; ++i) {
+    segments_.emplace_back(run_path + std::to_string(i) + "_",
+                           memory_budget_ / threads_);
+  }
+  using Clock = std::chrono::steady_clock;
+  struct Document {
+    size_t index = 0;
+    std::string path;
+    std::string text;
+  };
+  struct Inverted {
+    size_t index = 0;
+    size_t dl = 0;
+    std::string lines;
+  };
+  BoundedQueue<Document> crawled(read_ahead * threads_);
+  std::vector<std::unique_ptr<BoundedQueue<Document>>> queues;
+  StageStats crawl;
+  std::vector<StageStats> read(threads_);
+  std::vector<StageStats> invert(threads_);
+  std::vector<std::vector<Inverted>> inverted(threads_);
+  // Every queue exists before any thread looks one up.
+  for (size_t i = 0; i < threads_; ++i) {
+    queues.push_back(std::make_unique<BoundedQueue<Document>>(read_ahead));
+  }
+  std::vector<std::thread> workers;
+  workers.emplace_back([&source, &files, &crawled, &crawl]() {
+    auto start = Clock::now();
+    for (DocFile file; source(file);) {
+      auto found = Clock::now();
+      crawl.busy += Seconds(start, found);
+      crawl.bytes += file.size;
+      files.push_back(file);
+      crawled.Push(Document{files.size() - 1, std::move(file.path), {}});
+      ++crawl.items;
+      start = Clock::now();
+      crawl.waiting += Seconds(found, start);
+    }
+    crawl.busy += Seconds(start, Clock::now());
+    crawled.Close();
+  });
+  for (size_t i = 0; i < threads_; ++i) {
+    // A reader pops ascending DIDs, so its tokenizing thread adds them to
+    // the segment in order.
+    workers.emplace_back([&crawled, &queues, &read, i]() {
+      Document document;
+      while (crawled.Pop(document)) {
+        auto start = Clock::now();
+        ReadFile(document.path, document.text);
+        read[i].bytes += document.text.size();
+        auto loaded = Clock::now();
+        queues[i]->Push(std::move(document));
+        read[i].busy += Seconds(start, loaded);
+        read[i].waiting += Seconds(loaded, Clock::now());
+        ++read[i].items;
       }
+      queues[i]->Close();
+    });
+    workers.emplace_back([&queues, &invert, &inverted, i, first_DID, this]() {
+      Document document;
+      auto start = Clock::now();
+      while (queues[i]->Pop(document)) {
+        auto popped = Clock::now();
+        invert[i].waiting += Seconds(start, popped);
+        invert[i].bytes += document.text.size();
+        Inverted& result = inverted[i].emplace_back();
+        result.index = document.index;
+        result.dl = ParseDocument(document.text, first_DID + document.index,
+                                  segments_[i], result.lines);
+        ++invert[i].items;
+        start = Clock::now();
+        invert[i].busy += Seconds(popped, start);
+      }
+      segments_[i].Update();
+      invert[i].busy += Seconds(start, Clock::now());
+    });
+  }
+  for (auto& worker : workers) {
+    worker.join();
+  }
+  std::vector<size_t> lengths(files.size());
+  line_tables.assign(files.size(), "");
+  for (auto& documents : inverted) {
+    for (auto& document : documents) {
+      lengths[document.index] = document.dl;
+      line_tables[document.index] = std::move(document.lines);
     }
   }
-  term_info.close();
-  posting_table.close();
-  position_table.close();
-  Clear();
+  crawl_stats_.Add(crawl);
+  for (size_t i = 0; i < threads_; ++i) {
+    read_stats_.Add(read[i]);
+    invert_stats_.Add(invert[i]);
+    queue_stats_.Add(queues[i]->Stats());
+  }
+  return lengths;
 }
 
-void ii::InvertedIndex::ParseDocument(const std::string& path) {
-  std::ifstream file(path);
-  std::string str;
-  std::string term;
-  size_t line = 0;
-  size_t dl = 0;
-  size_t DID = N;
-  ++N;
-  while (std::getline(file, str)) {
-    ++line;
-    std::stringstream ss(str);
-    while (ss >> term) {
-      term.erase(std::remove_if(term.begin(), term.end(),
-                                [](char c) {
-                                  return (c != '-' && c != '_' && ispunct(c));
-                                }),
-                 term.end());
-      std::transform(term.begin(), term.end(), term.begin(), ::tolower);
-      if (term.size() != 0 && term != "-" && term != "_") {
-        ++dl;
-        if (!terms_.contains(term)) {
-          terms_[term] = terms_.size();
-          std::map<size_t, size_t> m;
-          std::vector<size_t> v;
-          m[DID] = 1;
-          v.emplace_back(line);
-          posting_table_.emplace_back(m);
-          position_table_.emplace_back(v);
-        } else {
-          ++posting_table_[terms_[term]][DID];
-          position_table_[terms_[term]].emplace_back(line);
-        }
+std::vector<ii::DocFile> ii::InvertedIndex::Crawl() {
+  auto start = std::chrono::steady_clock::now();
+  std::vector<DocFile> files;
+  Crawler crawler(input_directory_);
+  for (DocFile file; crawler.Next(file);) {
+    files.push_back(std::move(file));
+  }
+  crawl_stats_.busy += Seconds(start, std::chrono::steady_clock::now());
+  return files;
+}
+
+ii::FileSource ii::InvertedIndex::Files(const std::vector<DocFile>& files) {
+  return [&files, i = size_t(0)](DocFile& file) mutable {
+    if (i == files.size()) {
+      return false;
+    }
+    file = files[i++];
+    return true;
+  };
+}
+
+ii::DocExtent ii::InvertedIndex::WriteDocs(
+    const std::string& directory, const std::vector<DocFile>& files,
+    const std::vector<size_t>& lengths,
+    const std::vector<std::string>& line_tables, const bool append) const {
+  auto path = [&directory](const std::string& file) {
+    return directory + std::filesystem::path(file).filename().string();
+  };
+  DocExtent extent = append ? doc_extent_ : DocExtent{0, 0, 0};
+  if (append) {
+    // Searchers only read the extent in segments.bin, so whatever an
+    // interrupted update left past it is cut off before appending.
+    std::filesystem::resize_file(path(doc_info_path),
+                                 extent.size * DocTable::record_size);
+    std::filesystem::resize_file(path(doc_path_path), extent.path_bytes);
+    std::filesystem::resize_file(path(doc_line_path), extent.line_bytes);
+    std::filesystem::resize_file(path(doc_stat_path),
+                                 extent.size * 2 * sizeof(uint64_t));
+  }
+  auto mode = std::ios::binary | (append ? std::ios::app : std::ios::trunc);
+  std::ofstream doc_info(path(doc_info_path), mode);
+  std::ofstream doc_path(path(doc_path_path), mode);
+  std::ofstream doc_stat(path(doc_stat_path), mode);
+  std::ofstream doc_line(path(doc_line_path), mode);
+  for (size_t i = 0; i < files.size(); ++i) {
+    DocTable::Write(doc_info, lengths[i], extent.path_bytes,
+                    extent.line_bytes);
+    doc_path << files[i].path;
+    extent.path_bytes += files[i].path.size();
+    doc_line << line_tables[i];
+    extent.line_bytes += line_tables[i].size();
+    WriteFixed64(doc_stat, files[i].mtime);
+    WriteFixed64(doc_stat, files[i].size);
+  }
+  extent.size += files.size();
+  return extent;
+}
+
+size_t ii::InvertedIndex::StoredGeneration() const {
+  MappedFile segments;
+  if (!segments.Open(segments_path)) {
+    return 0;
+  }
+  Cursor cursor = segments.At(0);
+  for (int i = 0; i < 3; ++i) {
+    cursor.ReadVarint();
+  }
+  return cursor.AtEnd() ? 0 : cursor.ReadVarint();
+}
+
+void ii::InvertedIndex::WriteInfo(
+    const std::vector<uint8_t>& tombstones) const {
+  size_t generation = StoredGeneration() + 1;
+  std::ofstream info(Staged(info_path), std::ios::binary);
+  Write(info, N);
+  Write(info, dl_all);
+  info.close();
+  Publish(info_path);
+  std::ofstream tombstone(Staged(tombstone_path), std::ios::binary);
+  tombstone.write(reinterpret_cast<const char*>(tombstones.data()),
+                  tombstones.size());
+  tombstone.close();
+  Publish(tombstone_path);
+  std::ofstream segments(Staged(segments_path), std::ios::binary);
+  Write(segments, deltas_);
+  Write(segments, static_cast<size_t>(codec_));
+  Write(segments, impact_N_);
+  Write(segments, generation);
+  Write(segments, doc_extent_.size);
+  Write(segments, doc_extent_.path_bytes);
+  Write(segments, doc_extent_.line_bytes);
+  segments.close();
+  Publish(segments_path);
+}
+
+std::string ii::InvertedIndex::Staged(const std::string& path) {
+  return path + ".tmp";
+}
+
+void ii::InvertedIndex::Publish(const std::string& path) const {
+  std::filesystem::rename(Staged(path), path);
+}
+
+void ii::InvertedIndex::PublishDirectory(const std::string& directory) const {
+  for (const auto& file : std::filesystem::directory_iterator(directory)) {
+    std::filesystem::rename(file.path(),
+                            info_directory / file.path().filename());
+  }
+  std::filesystem::remove(directory);
+}
+
+bool ii::InvertedIndex::ReadInfo(std::vector<uint8_t>& tombstones) {
+  MappedFile info;
+  MappedFile segments;
+  MappedFile tombstone;
+  if (!info.Open(info_path) || !segments.Open(segments_path) ||
+      !tombstone.Open(tombstone_path)) {
+    return false;
+  }
+  Cursor cursor = info.At(0);
+  N = cursor.ReadVarint();
+  dl_all = cursor.ReadVarint();
+  Cursor cursor_segments = segments.At(0);
+  deltas_ = cursor_segments.ReadVarint();
+  if (!cursor_segments.AtEnd()) {
+    codec_ = static_cast<Codec>(cursor_segments.ReadVarint());
+  }
+  impact_N_ = cursor_segments.AtEnd() ? 0 : cursor_segments.ReadVarint();
+  doc_extent_ = DocExtent();
+  if (!cursor_segments.AtEnd()) {
+    cursor_segments.ReadVarint();
+  }
+  if (!cursor_segments.AtEnd()) {
+    doc_extent_.size = cursor_segments.ReadVarint();
+    doc_extent_.path_bytes = cursor_segments.ReadVarint();
+    doc_extent_.line_bytes = cursor_segments.ReadVarint();
+  }
+  tombstones.assign(tombstone.Data(), tombstone.Data() + tombstone.Size());
+  return true;
+}
+
+void ii::InvertedIndex::Lock() {
+  if (lock_ != -1) {
+    return;
+  }
+  lock_ = open(lock_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  while (lock_ != -1 && flock(lock_, LOCK_EX) == -1 && errno == EINTR) {
+  }
+}
+
+void ii::InvertedIndex::Unlock() {
+  if (lock_ != -1) {
+    close(lock_);
+    lock_ = -1;
+  }
+}
+
+void ii::InvertedIndex::CompactInBackground() {
+  pid_t child = fork();
+  if (child == -1) {
+    Compact();
+    return;
+  }
+  if (child == 0) {
+    // The middle process exits at once, so the compacting one is not left
+    // to the caller to reap.
+    setsid();
+    if (fork() == 0) {
+      // The copy of the descriptor shares the lock of the parent, the
+      // compaction waits for its own.
+      Unlock();
+      try {
+        Compact();
+      } catch (...) {
+        _exit(1);
       }
-      if (Size() >= 32768) {
-        Update();
+      _exit(0);
+    }
+    _exit(0);
+  }
+  waitpid(child, nullptr, 0);
+}
+
+void ii::InvertedIndex::Build(const FileSource& source) {
+  Lock();
+  // The new segment is written aside, the old one may still be searched.
+  std::filesystem::remove_all(compact_directory);
+  std::filesystem::create_directories(compact_directory);
+  std::vector<DocFile> files;
+  std::vector<std::string> line_tables;
+  std::vector<size_t> lengths = Index(source, 0, files, line_tables);
+  N = files.size();
+  dl_all = 0;
+  for (size_t dl : lengths) {
+    dl_all += dl;
+  }
+  impact_N_ = impacts_ ? N : 0;
+  MergeRuns(SegmentFiles(compact_directory), lengths, 0);
+  doc_extent_ =
+      WriteDocs(compact_directory, files, lengths, line_tables, false);
+  PublishDirectory(compact_directory);
+  ClearFiles();
+  deltas_ = 0;
+  WriteInfo(std::vector<uint8_t>((files.size() + 7) / 8));
+}
+
+void ii::InvertedIndex::Update(const std::vector<DocFile>& files) {
+  Lock();
+  std::vector<uint8_t> tombstones;
+  DocTable docs;
+  MappedFile doc_stat;
+  if (!ReadInfo(tombstones) ||
+      !docs.Open(doc_info_path, doc_path_path, doc_line_path, doc_extent_) ||
+      !doc_stat.Open(doc_stat_path)) {
+    Build(Files(files));
+    return;
+  }
+  doc_extent_ = docs.Bounds();
+  size_t first_DID = docs.Size();
+  tombstones.resize((first_DID + 7) / 8);
+  std::unordered_map<std::string_view, size_t> live;
+  for (size_t DID = 0; DID < first_DID; ++DID) {
+    if (!(tombstones[DID / 8] & (1 << (DID % 8)))) {
+      live.emplace(docs.Path(DID), DID);
+    }
+  }
+  auto remove_doc = [&](size_t DID) {
+    tombstones[DID / 8] |= 1 << (DID % 8);
+    dl_all -= docs.Length(DID);
+    --N;
+  };
+  std::vector<DocFile> added;
+  for (const auto& file : files) {
+    auto it = live.find(file.path);
+    if (it == live.end()) {
+      added.push_back(file);
+      continue;
+    }
+    const uint8_t* stat = doc_stat.Data() + it->second * 2 * sizeof(uint64_t);
+    if (LoadFixed64(stat) != file.mtime ||
+        LoadFixed64(stat + sizeof(uint64_t)) != file.size) {
+      remove_doc(it->second);
+      added.push_back(file);
+    }
+    live.erase(it);
+  }
+  for (const auto& [path, DID] : live) {
+    remove_doc(DID);
+  }
+  live.clear();
+  docs.Close();
+  doc_stat.Close();
+  if (!added.empty()) {
+    std::vector<DocFile> indexed;
+    std::vector<std::string> line_tables;
+    std::vector<size_t> lengths =
+        Index(Files(added), first_DID, indexed, line_tables);
+    std::string directory = DeltaDirectory(info_directory, deltas_ + 1);
+    std::filesystem::create_directories(directory);
+    N += added.size();
+    for (size_t dl : lengths) {
+      dl_all += dl;
+    }
+    MergeRuns(SegmentFiles(directory), lengths, first_DID);
+    doc_extent_ =
+        WriteDocs(info_directory, indexed, lengths, line_tables, true);
+    ++deltas_;
+    tombstones.resize((first_DID + added.size() + 7) / 8);
+  }
+  WriteInfo(tombstones);
+  if (deltas_ > max_deltas || N * 2 < first_DID + added.size()) {
+    CompactInBackground();
+  }
+}
+
+void ii::InvertedIndex::Compact() {
+  Lock();
+  std::vector<uint8_t> tombstones;
+  if (!ReadInfo(tombstones)) {
+    return;
+  }
+  if (deltas_ == 0 &&
+      std::all_of(tombstones.begin(), tombstones.end(),
+                  [](uint8_t byte) { return byte == 0; })) {
+    return;
+  }
+  std::filesystem::create_directories(compact_directory);
+  {
+    DocTable docs;
+    MappedFile doc_stat;
+    docs.Open(doc_info_path, doc_path_path, doc_line_path, doc_extent_);
+    doc_stat.Open(doc_stat_path);
+    std::vector<size_t> remap(docs.Size(), SIZE_MAX);
+    std::vector<DocFile> files;
+    std::vector<size_t> lengths;
+    std::vector<std::string> line_tables;
+    for (size_t DID = 0; DID < docs.Size(); ++DID) {
+      if (DID / 8 < tombstones.size() &&
+          (tombstones[DID / 8] & (1 << (DID % 8)))) {
+        continue;
       }
+      remap[DID] = files.size();
+      const uint8_t* stat = doc_stat.Data() + DID * 2 * sizeof(uint64_t);
+      files.push_back(DocFile{std::string(docs.Path(DID)), LoadFixed64(stat),
+                              LoadFixed64(stat + sizeof(uint64_t))});
+      lengths.push_back(docs.Length(DID));
+      line_tables.emplace_back(docs.LineTable(DID));
     }
+    std::vector<Dictionary> dictionaries(deltas_ + 1);
+    std::vector<MappedFile> posting_tables(deltas_ + 1);
+    std::vector<MappedFile> position_tables(deltas_ + 1);
+    std::vector<MergeSource> sources;
+    for (size_t i = 0; i <= deltas_; ++i) {
+      SegmentFiles segment(i == 0 ? info_directory
+                                  : DeltaDirectory(info_directory, i));
+      dictionaries[i].Open(segment.term_info_path, segment.term_index_path);
+      posting_tables[i].Open(segment.posting_table_path);
+      position_tables[i].Open(segment.position_table_path);
+      sources.push_back(MergeSource{
+          [it = dictionaries[i].Iterate()](TermEntry& entry) mutable {
+            return it.Next(entry);
+          },
+          &posting_tables[i], &position_tables[i], codec_, impact_N_ != 0});
+    }
+    if (impact_N_ != 0) {
+      impact_N_ = N;
+    }
+    Merge(sources, SegmentFiles(compact_directory), remap, lengths, 0);
+    doc_extent_ =
+        WriteDocs(compact_directory, files, lengths, line_tables, false);
+  }
+  PublishDirectory(compact_directory);
+  for (size_t i = 1; i <= deltas_; ++i) {
+    std::filesystem::remove_all(DeltaDirectory(info_directory, i));
   }
-  dl_all += dl;
-  std::ofstream doc_info(doc_info_path, std::ios::binary | std::ios::app);
-  Write(doc_info, DID);
-  Write(doc_info, dl);
-  Write(doc_info, path.size());
-  doc_info << path;
-  doc_info.close();
+  deltas_ = 0;
+  WriteInfo(std::vector<uint8_t>((N + 7) / 8));
+}
+
+void ii::InvertedIndex::ReportStats(std::ostream& out) const {
+  auto row = [&out](const char* stage, const StageStats& stats) {
+    double mb = stats.bytes / double(1 << 20);
+    out << stage << '\t' << stats.items << '\t' << mb << '\t' << stats.busy
+        << '\t' << stats.waiting << '\t'
+        << (stats.busy > 0 ? mb / stats.busy : 0) << '\n';
+  };
+  out << "stage\tfiles\tMB\tbusy s\twait s\tMB/busy s\n";
+  row("crawl", crawl_stats_);
+  row("read", read_stats_);
+  row("invert", invert_stats_);
+  if (queue_stats_.pushes != 0) {
+    out << "queue: capacity " << queue_stats_.capacity << ", mean occupancy "
+        << (double)queue_stats_.occupancy / queue_stats_.pushes
+        << ", full on " << 100.0 * queue_stats_.full / queue_stats_.pushes
+        << "% of pushes\n";
+    // Readers wait on a full queue when tokenizing is the bottleneck,
+    // tokenizers wait on an empty one when reading is.
+    out << "bound: "
+        << (invert_stats_.waiting > read_stats_.waiting ? "io" : "cpu")
+        << '\n';
+  }
+}
+
+std::unique_ptr<ii::InvertedIndex> ii::InvertedIndex::ShardIndex(
+    const size_t shard) const {
+  auto index =
+      std::make_unique<InvertedIndex>(ShardDirectory(info_directory, shard));
+  index->threads_ = threads_;
+  index->memory_budget_ = memory_budget_;
+  index->codec_ = codec_;
+  index->impacts_ = impacts_;
+  std::filesystem::create_directories(index->info_directory);
+  return index;
+}
+
+size_t ii::InvertedIndex::Shard(const std::string& path) const {
+  // FNV-1a, std::hash may change between builds.
+  uint64_t hash = 14695981039346656037ull;
+  for (size_t i = input_directory_.size(); i < path.size(); ++i) {
+    hash = (hash ^ static_cast<uint8_t>(path[i])) * 1099511628211ull;
+  }
+  return hash % shards_;
+}
+
+size_t ii::InvertedIndex::StoredShards() const {
+  MappedFile shards;
+  return shards.Open(shards_path) ? shards.At(0).ReadVarint() : 0;
+}
+
+void ii::InvertedIndex::BuildShards(const std::vector<DocFile>& files) {
+  // Files keep their sorted order within a shard, so shard DIDs follow the
+  // paths like the DIDs of a single index.
+  std::vector<std::vector<DocFile>> parts(shards_);
+  for (const auto& file : files) {
+    parts[Shard(file.path)].push_back(file);
+  }
+  bool update = update_ && StoredShards() == shards_;
+  for (size_t i = 0; i < shards_; ++i) {
+    std::unique_ptr<InvertedIndex> shard = ShardIndex(i);
+    if (update) {
+      shard->Update(parts[i]);
+    } else {
+      shard->Build(Files(parts[i]));
+    }
+    crawl_stats_.Add(shard->crawl_stats_);
+    read_stats_.Add(shard->read_stats_);
+    invert_stats_.Add(shard->invert_stats_);
+    queue_stats_.Add(shard->queue_stats_);
+  }
+  WriteShards(shards_);
+  // Shards past the count and the deltas of a single index are left over
+  // from an earlier build.
+  for (size_t i = shards_;
+       std::filesystem::exists(ShardDirectory(info_directory, i)); ++i) {
+    std::filesystem::remove_all(ShardDirectory(info_directory, i));
+  }
+  for (size_t i = 1; std::filesystem::exists(DeltaDirectory(info_directory, i));
+       ++i) {
+    std::filesystem::remove_all(DeltaDirectory(info_directory, i));
+  }
+}
+
+void ii::InvertedIndex::WriteShards(const size_t shards) const {
+  size_t generation = 0;
+  if (MappedFile stored; stored.Open(shards_path)) {
+    Cursor cursor = stored.At(0);
+    cursor.ReadVarint();
+    generation = cursor.ReadVarint();
+  }
+  std::ofstream file(Staged(shards_path), std::ios::binary);
+  Write(file, shards);
+  Write(file, generation + 1);
+  file.close();
+  Publish(shards_path);
 }
 
 void ii::InvertedIndex::ClearFiles() {
-  std::ofstream doc_info(doc_info_path);
-  std::ofstream term_info(term_info_path);
-  std::ofstream posting_table(posting_table_path);
-  std::ofstream position_table(position_table_path);
-  doc_info.close();
-  term_info.close();
-  posting_table.close();
-  position_table.close();
+  for (size_t i = 1; std::filesystem::exists(DeltaDirectory(info_directory, i));
+       ++i) {
+    std::filesystem::remove_all(DeltaDirectory(info_directory, i));
+  }
+  std::filesystem::remove_all(compact_directory);
+  for (size_t i = 0; std::filesystem::exists(ShardDirectory(info_directory, i));
+       ++i) {
+    std::filesystem::remove_all(ShardDirectory(info_directory, i));
+  }
+  std::filesystem::remove(shards_path);
 }
 
 void ii::InvertedIndex::Launcher(int argc, char** argv) {
@@ -149,16 +1079,31 @@ void ii::InvertedIndex::Launcher(int argc, char** argv) {
         std::cerr << "Invalid Arguments\n";
         exit(0);
     }
-  ClearFiles();
-  for (const auto& file :
-       std::filesystem::recursive_directory_iterator(input_directory_)) {
-    if (!std::filesystem::is_directory(file)) {
-      ParseDocument(file.path().string());
+  std::filesystem::create_directories(info_directory);
+  if (!input_directory_.empty()) {
+    // DIDs follow the sorted paths. A build indexes the files as the crawler
+    // finds them, an update needs all of them to tell the deleted ones.
+    if (shards_ > 1) {
+      BuildShards(Crawl());
+    } else if (update_ && StoredShards() == 0) {
+      Update(Crawl());
+    } else {
+      Crawler crawler(input_directory_);
+      Build([&crawler](DocFile& file) { return crawler.Next(file); });
     }
   }
-  Update();
-  std::ofstream info(info_path, std::ios::binary);
-  Write(info, N);
-  Write(info, dl_all);
-  info.close();
-}
\ No newline at end of file
+  if (compact_) {
+    if (size_t shards = StoredShards(); shards > 0) {
+      for (size_t i = 0; i < shards; ++i) {
+        ShardIndex(i)->Compact();
+      }
+      WriteShards(shards);
+    } else {
+      Compact();
+    }
+  }
+  Unlock();
+  if (stats_) {
+    ReportStats(std::cout);
+  }
+}
@@ -1,52 +1,320 @@
 #pragma once
 
 #include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
 #include <cstdint>
+#include <cstring>
 #include <filesystem>
 #include <fstream>
+#include <functional>
 #include <iostream>
 #include <iterator>
 #include <map>
+#include <memory>
+#include <queue>
 #include <regex>
 #include <set>
 #include <sstream>
 #include <stack>
 #include <string>
+#include <thread>
 #include <unordered_map>
 #include <vector>
 
+#include "bm25.h"
+#include "bounded_queue.h"
+#include "codec.h"
+#include "crawler.h"
+#include "dictionary.h"
+#include "doc_table.h"
+#include "mapped_file.h"
+#include "segment_files.h"
+#include "tokenizer.h"
+#include "varint.h"
+
 namespace ii {
 
+// Strips punctuation other than '-' and '_' from a whitespace-separated word
+// and lowercases it. Returns false when nothing indexable is left.
+bool NormalizeTerm(std::string& term);
+
+// Bump allocator for the bytes of an in-memory segment. Memory comes in
+// blocks and is only given back all at once.
+class Arena {
+  std::vector<std::unique_ptr<uint8_t[]>> blocks_;
+  uint8_t* ptr_ = nullptr;
+  uint8_t* end_ = nullptr;
+  size_t bytes_ = 0;
+
+ public:
+  static constexpr size_t block_size = 64 << 10;
+
+  uint8_t* Allocate(const size_t size);
+
+  // Bytes taken from the heap.
+  size_t Bytes() const { return bytes_; }
+
+  void Clear();
+};
+
+// In-memory inversion of a disjoint set of documents. Terms live in an
+// open-addressing hash table with their bytes interned in an arena. Every
+// term appends its postings to a buffer of its own, a chain of growing arena
+// slices holding a varint DID gap and position delta per occurrence. DIDs
+// only grow, so appending is enough and terms are sorted only when flushed.
+// Whenever the segment grows past its memory budget it is flushed as a
+// sorted run into its own run files, so several segments can be filled by
+// different threads at once.
+class Segment {
+  struct Term {
+    const uint8_t* text;
+    uint32_t size;
+    uint32_t df;
+    size_t hash;
+    uint8_t* head;
+    uint8_t* slice;
+    uint8_t* ptr;
+    uint8_t* end;
+    uint32_t level;
+    size_t last_DID;
+    size_t last_position;
+  };
+
+  Arena arena_;
+  std::vector<Term> terms_;
+  std::vector<uint32_t> slots_;
+
+  std::string term_run_path_;
+  std::string posting_run_path_;
+  std::string position_run_path_;
+
+  std::vector<size_t> runs_;
+
+  size_t memory_ = 0;
+  size_t memory_budget_;
+
+  static constexpr uint32_t empty_slot = UINT32_MAX;
+  static constexpr size_t slice_levels = 8;
+
+  static size_t Allocation(const size_t bytes);
+
+  static size_t SliceSize(const uint32_t level);
+
+  Term& Find(std::string_view term);
+
+  void Grow();
+
+  void Append(Term& term, size_t value);
+
+  void Clear();
+
+ public:
+  Segment(const std::string& run_path, const size_t memory_budget);
+
+  size_t Size() const;
+
+  bool Full() const;
+
+  void Add(std::string_view term, const size_t DID, const size_t position);
+
+  void Update();
+
+  void RemoveRuns() const;
+
+  const std::vector<size_t>& Runs() const;
+
+  const std::string& TermRunPath() const;
+
+  const std::string& PostingRunPath() const;
+
+  const std::string& PositionRunPath() const;
+};
+
+// Volume and time of one indexing stage, summed over its threads. Busy time
+// leaves out waiting on the queues around the stage.
+struct StageStats {
+  size_t items = 0;
+  size_t bytes = 0;
+  double busy = 0;
+  double waiting = 0;
+
+  void Add(const StageStats& other) {
+    items += other.items;
+    bytes += other.bytes;
+    busy += other.busy;
+    waiting += other.waiting;
+  }
+};
+
+// Yields the files to index one at a time, false after the last one.
+using FileSource = std::function<bool(DocFile&)>;
+
+struct MergeSource {
+  std::function<bool(TermEntry&)> next;
+  const MappedFile* posting_table;
+  const MappedFile* position_table;
+  Codec codec;
+  bool impacts;
+};
+
 class InvertedIndex {
   std::string input_directory_;
+  size_t threads_ = 1;
+  size_t memory_budget_ = 256 << 20;
+  Codec codec_ = Codec::Varint;
+  bool impacts_ = false;
+  bool update_ = false;
+  bool compact_ = false;
+  bool stats_ = false;
+  size_t shards_ = 1;
+
+  StageStats crawl_stats_;
+  StageStats read_stats_;
+  StageStats invert_stats_;
+  QueueStats queue_stats_;
 
   size_t dl_all = 0;
   size_t N = 0;
+  size_t deltas_ = 0;
+  // Document count the impact scale was fixed with, zero without impacts.
+  // Delta segments keep it and score with their own df until compaction.
+  size_t impact_N_ = 0;
+  // Part of the document tables the index metadata covers.
+  DocExtent doc_extent_;
+
+  std::vector<Segment> segments_;
+
+  const size_t max_deltas = 8;
+  // Descriptor holding the write lock of the index directory, or -1.
+  int lock_ = -1;
+  // Documents read ahead of every tokenizing thread.
+  const size_t read_ahead = 16;
 
-  std::map<std::string, size_t> terms_;
-  std::vector<std::map<size_t, size_t>> posting_table_;
-  std::vector<std::vector<size_t>> position_table_;
+  const std::string info_directory;
+  const std::string doc_info_path = info_directory + "doc.bin";
+  const std::string doc_path_path = info_directory + "doc_path.bin";
+  const std::string doc_stat_path = info_directory + "doc_stat.bin";
+  const std::string doc_line_path = info_directory + "doc_line.bin";
+  const std::string tombstone_path = info_directory + "tombstone.bin";
+  const std::string segments_path = info_directory + "segments.bin";
+  const std::string info_path = info_directory + "info.bin";
+  const std::string shards_path = info_directory + "shards.bin";
+  const std::string lock_path = info_directory + "lock";
 
-  const std::string doc_info_path = "info/doc.bin";
-  const std::string term_info_path = "info/term.bin";
-  const std::string posting_table_path = "info/posting_table.bin";
-  const std::string position_table_path = "info/position_table.bin";
-  const std::string info_path = "info/info.bin";
+  const std::string run_path = info_directory + "segment_";
+  const std::string compact_directory = info_directory + "compact/";
 
   void Write(std::ofstream& file, const size_t n) const;
 
-  void Clear();
+  bool ReadTerm(Cursor& cursor, TermEntry& run) const;
 
-  void Update();
+  // Merges the terms of the sources and, within a term, their postings by
+  // DID. A document split over runs of one segment takes its positions in
+  // source order.
+  void Merge(std::vector<MergeSource>& sources, const SegmentFiles& output,
+             const std::vector<size_t>& remap,
+             const std::vector<size_t>& lengths, const size_t first_DID) const;
+
+  void MergeRuns(const SegmentFiles& output,
+                 const std::vector<size_t>& lengths, const size_t first_DID);
+
+  // Adds the terms of a document with their token positions and returns its
+  // length, the line table of the document goes to lines. The text is
+  // tokenized in place.
+  size_t ParseDocument(std::string& text, const size_t DID, Segment& segment,
+                       std::string& lines) const;
+
+  // A crawler thread numbers the files of the source from first_DID as they
+  // come and queues them for the readers. Every reader feeds a bounded queue
+  // of its own tokenizing thread, which owns a segment, so the crawl and the
+  // reads overlap with inverting. Segments take documents in turns, so their
+  // runs are merged by DID. The indexed files come out in DID order.
+  std::vector<size_t> Index(const FileSource& source, const size_t first_DID,
+                            std::vector<DocFile>& files,
+                            std::vector<std::string>& line_tables);
+
+  // Walks the whole input directory, for the updates and shards that need
+  // every file before the first one is indexed.
+  std::vector<DocFile> Crawl();
+
+  static FileSource Files(const std::vector<DocFile>& files);
+
+  // Writes the document tables, or with append adds to the ones of
+  // doc_extent_ in place, and returns the extent of the result.
+  DocExtent WriteDocs(const std::string& directory,
+                      const std::vector<DocFile>& files,
+                      const std::vector<size_t>& lengths,
+                      const std::vector<std::string>& line_tables,
+                      const bool append) const;
+
+  // Every write of the index metadata bumps the generation in segments.bin,
+  // so searchers can tell cached results of an older index apart.
+  size_t StoredGeneration() const;
 
-  void ParseDocument(const std::string& path);
+  // Searchers may have the files of the index mapped, so new ones are
+  // written under a staged name and renamed into place, and the searchers
+  // keep reading the old ones whole.
+  static std::string Staged(const std::string& path);
+
+  void Publish(const std::string& path) const;
+
+  // Moves every file written to the directory into the index directory.
+  void PublishDirectory(const std::string& directory) const;
+
+  // Writes segments.bin last, so a searcher that sees its new generation
+  // finds the rest of the metadata new too.
+  void WriteInfo(const std::vector<uint8_t>& tombstones) const;
+
+  bool ReadInfo(std::vector<uint8_t>& tombstones);
+
+  void Build(const FileSource& source);
+
+  void Update(const std::vector<DocFile>& files);
+
+  // Drops deleted documents and merges the delta segments into the main
+  // one. Does nothing when there is neither.
+  void Compact();
+
+  // Writers of an index directory take turns on an exclusive lock, so an
+  // update waits for a compaction still running in the background. The lock
+  // is held from the first write until Unlock.
+  void Lock();
+
+  void Unlock();
+
+  // Leaves the compaction to a detached process, which starts once this one
+  // releases the lock, so an update returns as soon as its delta segment is
+  // published.
+  void CompactInBackground();
+
+  // Index of one shard with the options of this one.
+  std::unique_ptr<InvertedIndex> ShardIndex(const size_t shard) const;
+
+  // Shard of a file, from a hash of its path below the input directory, so
+  // a file stays in its shard across updates.
+  size_t Shard(const std::string& path) const;
+
+  // Number of shards in shards.bin, zero for an index that is not sharded.
+  size_t StoredShards() const;
+
+  // Builds or, when the shard count is unchanged, updates every shard.
+  void BuildShards(const std::vector<DocFile>& files);
+
+  // Writes shards.bin with the next generation.
+  void WriteShards(const size_t shards) const;
 
   void ClearFiles();
 
   bool Parse(int argc, char** argv);
 
+  void ReportStats(std::ostream& out) const;
+
  public:
-  size_t Size() const;
+  InvertedIndex(const std::string& directory = "info/");
+
+  ~InvertedIndex();
 
   std::vector<uint8_t> VarintEncoding(size_t n) const;
 
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <list>
+#include <unordered_map>
+#include <utility>
+
+namespace sse {
+
+// Map of bounded size that evicts the least recently used entry.
+template <typename Key, typename Value>
+class LruCache {
+  using Item = std::pair<Key, Value>;
+
+  size_t capacity_;
+  std::list<Item> items_;
+  std::unordered_map<Key, typename std::list<Item>::iterator> index_;
+
+ public:
+  LruCache(size_t capacity) : capacity_(capacity) {}
+
+  const Value* Find(const Key& key) {
+    auto it = index_.find(key);
+    if (it == index_.end()) {
+      return nullptr;
+    }
+    items_.splice(items_.begin(), items_, it->second);
+    return &it->second->second;
+  }
+
+  void Insert(const Key& key, Value value) {
+    if (capacity_ == 0) {
+      return;
+    }
+    auto it = index_.find(key);
+    if (it != index_.end()) {
+      it->second->second = std::move(value);
+      items_.splice(items_.begin(), items_, it->second);
+      return;
+    }
+    if (items_.size() == capacity_) {
+      index_.erase(items_.back().first);
+      items_.pop_back();
+    }
+    items_.emplace_front(key, std::move(value));
+    index_.emplace(key, items_.begin());
+  }
+
+  void SetCapacity(size_t capacity) {
+    capacity_ = capacity;
+    while (items_.size() > capacity_) {
+      index_.erase(items_.back().first);
+      items_.pop_back();
+    }
+  }
+
+  void Clear() {
+    items_.clear();
+    index_.clear();
+  }
+
+  size_t Size() const { return items_.size(); }
+};
+
+}  // namespace sse
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+namespace ii {
+
+class Cursor {
+  const uint8_t* ptr_ = nullptr;
+  const uint8_t* end_ = nullptr;
+
+ public:
+  Cursor() = default;
+  Cursor(const uint8_t* begin, const uint8_t* end) : ptr_(begin), end_(end) {}
+
+  size_t ReadVarint() {
+    size_t ans = 0;
+    size_t shift = 0;
+    while (ptr_ != end_) {
+      uint8_t byte = *ptr_++;
+      ans |= static_cast<size_t>(byte & 127) << shift;
+      if (byte < 128) {
+        break;
+      }
+      shift += 7;
+    }
+    return ans;
+  }
+
+  std::string_view ReadBytes(size_t n) {
+    n = std::min<size_t>(n, end_ - ptr_);
+    std::string_view bytes(reinterpret_cast<const char*>(ptr_), n);
+    ptr_ += n;
+    return bytes;
+  }
+
+  void Skip(size_t n) { ptr_ += std::min<size_t>(n, end_ - ptr_); }
+
+  bool AtEnd() const { return ptr_ == end_; }
+
+  const uint8_t* Data() const { return ptr_; }
+
+  const uint8_t* End() const { return end_; }
+};
+
+// Read-only view of a whole index file. Everything the searcher decodes goes
+// through a Cursor pointing straight into the mapping.
+class MappedFile {
+  const uint8_t* data_ = nullptr;
+  size_t size_ = 0;
+  bool open_ = false;
+
+ public:
+  enum class Access { Normal, Sequential, Random };
+
+  MappedFile() = default;
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+  MappedFile(MappedFile&& other) noexcept;
+  MappedFile& operator=(MappedFile&& other) noexcept;
+  ~MappedFile();
+
+  bool Open(const std::string& path, Access access = Access::Normal);
+
+  void Close();
+
+  bool IsOpen() const { return open_; }
+
+  size_t Size() const { return size_; }
+
+  const uint8_t* Data() const { return data_; }
+
+  Cursor At(size_t offset) const {
+    offset = std::min(offset, size_);
+    return Cursor(data_ + offset, data_ + size_);
+  }
+
+  Cursor Range(size_t begin, size_t end) const {
+    end = std::min(end, size_);
+    begin = std::min(begin, end);
+    return Cursor(data_ + begin, data_ + end);
+  }
+};
+
+}  // namespace ii
@@ -0,0 +1,81 @@
+#include "posting_cache.h"
+
+size_t sse::DecodedPostings::Bytes() const {
+  return DIDs.capacity() * sizeof(size_t) + tfs.capacity() * sizeof(uint32_t) +
+         impacts.capacity() +
+         blocks.capacity() * sizeof(std::pair<size_t, ii::SkipEntry>);
+}
+
+std::shared_ptr<const sse::DecodedPostings> sse::PostingCache::Find(
+    const std::string& term) {
+  auto it = entries_.find(term);
+  if (it == entries_.end()) {
+    if (capacity_ != 0) {
+      // Counts of missed terms are only kept to pick the ones worth
+      // decoding, so they are simply dropped when there are too many.
+      if (seen_.size() >= max_seen) {
+        seen_.clear();
+      }
+      ++seen_[term];
+    }
+    return nullptr;
+  }
+  Entry& entry = it->second;
+  queue_.erase({entry.priority, term});
+  ++entry.requests;
+  entry.priority = age_ + entry.requests * entry.bytes;
+  queue_.emplace(entry.priority, term);
+  return entry.postings;
+}
+
+bool sse::PostingCache::Admits(const std::string& term) const {
+  auto it = seen_.find(term);
+  return it != seen_.end() && it->second >= 2;
+}
+
+void sse::PostingCache::Insert(
+    const std::string& term, std::shared_ptr<const DecodedPostings> postings) {
+  size_t bytes = postings->Bytes();
+  if (bytes > capacity_ || entries_.contains(term)) {
+    return;
+  }
+  size_t requests = 1;
+  if (auto it = seen_.find(term); it != seen_.end()) {
+    requests = it->second;
+    seen_.erase(it);
+  }
+  while (bytes_ + bytes > capacity_) {
+    Evict();
+  }
+  Entry entry{std::move(postings), bytes, requests, age_ + requests * bytes};
+  queue_.emplace(entry.priority, term);
+  entries_.emplace(term, std::move(entry));
+  bytes_ += bytes;
+}
+
+void sse::PostingCache::Evict() {
+  auto victim = queue_.begin();
+  age_ = victim->first;
+  auto it = entries_.find(victim->second);
+  bytes_ -= it->second.bytes;
+  entries_.erase(it);
+  queue_.erase(victim);
+}
+
+void sse::PostingCache::SetCapacity(size_t capacity) {
+  capacity_ = capacity;
+  while (bytes_ > capacity_) {
+    Evict();
+  }
+  if (capacity_ == 0) {
+    seen_.clear();
+  }
+}
+
+void sse::PostingCache::Clear() {
+  entries_.clear();
+  queue_.clear();
+  seen_.clear();
+  bytes_ = 0;
+  age_ = 0;
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "codec.h"
+
+namespace sse {
+
+// Postings of one term over all segments decoded into flat arrays, with
+// deleted documents already dropped. The blocks keep the bounds of the
+// encoded lists for block-max pruning.
+struct DecodedPostings {
+  std::vector<size_t> DIDs;
+  std::vector<uint32_t> tfs;
+  std::vector<uint8_t> impacts;
+  std::vector<std::pair<size_t, ii::SkipEntry>> blocks;
+
+  size_t Bytes() const;
+};
+
+// Decoded posting lists shared by all queries within a memory cap. A term is
+// admitted on its second request, so one-off terms are never decoded in
+// full. Entries are worth their size times their requests, which is what
+// they save from being decoded again, and the cheapest one is evicted first.
+// The worth of the last victim is added to every new one, so entries that
+// stop being requested age out.
+class PostingCache {
+  struct Entry {
+    std::shared_ptr<const DecodedPostings> postings;
+    size_t bytes;
+    size_t requests;
+    size_t priority;
+  };
+
+  size_t capacity_;
+  size_t bytes_ = 0;
+  size_t age_ = 0;
+  std::unordered_map<std::string, Entry> entries_;
+  std::set<std::pair<size_t, std::string>> queue_;
+  std::unordered_map<std::string, size_t> seen_;
+
+  static constexpr size_t max_seen = 1 << 16;
+
+  void Evict();
+
+ public:
+  PostingCache(size_t capacity) : capacity_(capacity) {}
+
+  // Counts the request and returns the decoded postings if they are cached.
+  std::shared_ptr<const DecodedPostings> Find(const std::string& term);
+
+  // Whether the postings of a term that was just missed should be decoded.
+  bool Admits(const std::string& term) const;
+
+  void Insert(const std::string& term,
+              std::shared_ptr<const DecodedPostings> postings);
+
+  void SetCapacity(size_t capacity);
+
+  size_t Capacity() const { return capacity_; }
+
+  void Clear();
+
+  size_t Bytes() const { return bytes_; }
+
+  size_t Size() const { return entries_.size(); }
+};
+
+}  // namespace sse
@@ -0,0 +1,99 @@
+#include "query_stats.h"
+
+#include <cmath>
+
+namespace {
+
+void WriteString(std::ostream& out, const std::string& text) {
+  const char hex[] = "0123456789abcdef";
+  out << '"';
+  for (unsigned char c : text) {
+    if (c == '"' || c == '\\') {
+      out << '\\' << c;
+    } else if (c < 0x20) {
+      out << "\\u00" << hex[c >> 4] << hex[c & 15];
+    } else {
+      out << c;
+    }
+  }
+  out << '"';
+}
+
+// Fields shared by a request and a session.
+void WriteCounters(std::ostream& out, const sse::QueryStats& stats) {
+  out << "\"ms\":{\"parse\":" << stats.parse * 1e3
+      << ",\"lookup\":" << stats.lookup * 1e3
+      << ",\"evaluate\":" << stats.evaluate * 1e3
+      << ",\"lines\":" << stats.lines * 1e3
+      << ",\"total\":" << stats.total * 1e3 << "},\"terms\":" << stats.terms
+      << ",\"found_terms\":" << stats.found_terms
+      << ",\"postings\":" << stats.postings << ",\"scored\":" << stats.scored
+      << ",\"results\":" << stats.results
+      << ",\"decoded\":" << stats.reads.postings
+      << ",\"bytes\":{\"term\":" << stats.reads.term_bytes
+      << ",\"posting\":" << stats.reads.posting_bytes
+      << ",\"position\":" << stats.reads.position_bytes << '}';
+}
+
+}  // namespace
+
+void sse::QueryStats::Add(const QueryStats& other) {
+  parse += other.parse;
+  lookup += other.lookup;
+  evaluate += other.evaluate;
+  lines += other.lines;
+  total += other.total;
+  terms += other.terms;
+  found_terms += other.found_terms;
+  postings += other.postings;
+  scored += other.scored;
+  results += other.results;
+  reads.Add(other.reads);
+}
+
+void sse::QueryStats::Write(std::ostream& out) const {
+  out << "{\"query\":";
+  WriteString(out, query);
+  out << ",\"k\":" << k << ",\"cached\":" << (cached ? "true" : "false")
+      << ',';
+  WriteCounters(out, *this);
+  out << '}';
+}
+
+void sse::LatencyHistogram::Add(double seconds) {
+  double ns = seconds * 1e9;
+  size_t bucket = ns < 1 ? 0 : static_cast<size_t>(std::log2(ns) * 8) + 1;
+  if (bucket >= counts_.size()) {
+    counts_.resize(bucket + 1);
+  }
+  ++counts_[bucket];
+  ++count_;
+}
+
+double sse::LatencyHistogram::Quantile(double q) const {
+  size_t rank = std::ceil(q * count_);
+  size_t seen = 0;
+  for (size_t bucket = 0; bucket < counts_.size(); ++bucket) {
+    seen += counts_[bucket];
+    if (seen >= rank && seen != 0) {
+      return std::exp2(bucket / 8.0) * 1e-9;
+    }
+  }
+  return 0;
+}
+
+void sse::SessionStats::Add(const QueryStats& query) {
+  ++queries;
+  cache_hits += query.cached;
+  totals.Add(query);
+  latency.Add(query.total);
+}
+
+void sse::SessionStats::Write(std::ostream& out) const {
+  out << "{\"queries\":" << queries << ",\"cache_hits\":" << cache_hits
+      << ",\"latency_ms\":{\"p50\":" << latency.Quantile(0.5) * 1e3
+      << ",\"p90\":" << latency.Quantile(0.9) * 1e3
+      << ",\"p99\":" << latency.Quantile(0.99) * 1e3 << "},";
+  WriteCounters(out, totals);
+  out << '}';
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <cstddef>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "read_counters.h"
+
+namespace sse {
+
+// Where the time of one request went and how much of the index it touched.
+// Phases are in seconds: splitting, checking and canonicalizing the request,
+// looking up and decoding the terms, matching and scoring, and reading the
+// lines of the results and printing them.
+struct QueryStats {
+  std::string query;
+  size_t k = 0;
+  bool cached = false;
+
+  double parse = 0;
+  double lookup = 0;
+  double evaluate = 0;
+  double lines = 0;
+  double total = 0;
+
+  size_t terms = 0;
+  size_t found_terms = 0;
+  // Length of the posting lists of the terms found, the candidates of an
+  // exhaustive disjunction.
+  size_t postings = 0;
+  size_t scored = 0;
+  size_t results = 0;
+  ii::ReadCounters reads;
+
+  void Add(const QueryStats& other);
+
+  // One line of JSON, times in milliseconds.
+  void Write(std::ostream& out) const;
+};
+
+// Latencies in buckets an eighth of a power of two wide, so a quantile is
+// overestimated by at most 9%.
+class LatencyHistogram {
+  std::vector<size_t> counts_;
+  size_t count_ = 0;
+
+ public:
+  void Add(double seconds);
+
+  size_t Count() const { return count_; }
+
+  // Upper bound in seconds of the bucket holding the q-quantile.
+  double Quantile(double q) const;
+};
+
+// Sums of the statistics of every request of a session.
+struct SessionStats {
+  size_t queries = 0;
+  size_t cache_hits = 0;
+  QueryStats totals;
+  LatencyHistogram latency;
+
+  void Add(const QueryStats& query);
+
+  void Write(std::ostream& out) const;
+};
+
+}  // namespace sse
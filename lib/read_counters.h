@@ -0,0 +1,32 @@
+#pragma once
+
+#include <cstddef>
+
+namespace ii {
+
+// Bytes of each index file and postings decoded by the readers of the
+// calling thread. Query statistics take the difference around a query.
+struct ReadCounters {
+  size_t term_bytes = 0;
+  size_t posting_bytes = 0;
+  size_t position_bytes = 0;
+  size_t postings = 0;
+
+  void Add(const ReadCounters& other) {
+    term_bytes += other.term_bytes;
+    posting_bytes += other.posting_bytes;
+    position_bytes += other.position_bytes;
+    postings += other.postings;
+  }
+
+  ReadCounters Since(const ReadCounters& start) const {
+    return ReadCounters{term_bytes - start.term_bytes,
+                        posting_bytes - start.posting_bytes,
+                        position_bytes - start.position_bytes,
+                        postings - start.postings};
+  }
+};
+
+inline thread_local ReadCounters read_counters;
+
+}  // namespace ii
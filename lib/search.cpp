@@ -1,38 +1,702 @@
 #include "search.h"
 
-size_t sse::SimpleSearchEngine::Read(std::ifstream& file) const {
-  std::vector<uint8_t> bytes;
-  uint8_t byte;
-  file.read(reinterpret_cast<char*>(&byte), 1);
-  bytes.emplace_back(byte);
-  while (byte / 128 != 0) {
-    file.read(reinterpret_cast<char*>(&byte), 1);
-    bytes.emplace_back(byte);
+#include <sys/stat.h>
+
+#include <charconv>
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+double Seconds(Clock::time_point start, Clock::time_point end) {
+  return std::chrono::duration<double>(end - start).count();
+}
+
+// Larger NEAR distances are not operators, so such requests are invalid.
+constexpr size_t max_near_distance = 1 << 20;
+
+// "NEAR/n" operator token.
+bool IsNear(const std::string& token, size_t* distance = nullptr) {
+  if (token.size() <= 5 || token.compare(0, 5, "NEAR/") != 0 ||
+      !std::all_of(token.begin() + 5, token.end(), ::isdigit)) {
+    return false;
+  }
+  size_t n;
+  auto [end, error] =
+      std::from_chars(token.data() + 5, token.data() + token.size(), n);
+  if (error != std::errc() || n > max_near_distance) {
+    return false;
+  }
+  if (distance != nullptr) {
+    *distance = n;
+  }
+  return true;
+}
+
+bool IsOperator(const std::string& token) {
+  return token == "AND" || token == "OR" || IsNear(token);
+}
+
+// Quoted phrase token with at least one term.
+bool IsPhrase(const std::string& token) {
+  return token.size() > 2 && token.front() == '"' && token.back() == '"';
+}
+
+// Terms of a phrase token, normalized the way the indexer does it.
+std::vector<std::string> PhraseTerms(const std::string& token) {
+  std::vector<std::string> terms;
+  std::istringstream words(token.substr(1, token.size() - 2));
+  for (std::string term; words >> term;) {
+    if (ii::NormalizeTerm(term)) {
+      terms.push_back(term);
+    }
+  }
+  return terms;
+}
+
+// Runs task(i) for every i below n on the pool and the calling thread, or
+// on the calling thread alone without a pool. Index reads of the pool
+// threads are added to reads, those of the calling thread stay in its own
+// counters.
+void Parallel(sse::ThreadPool* pool, const size_t n,
+              const std::function<void(size_t)>& task,
+              ii::ReadCounters& reads) {
+  if (!pool) {
+    for (size_t i = 0; i < n; ++i) {
+      task(i);
+    }
+    return;
+  }
+  std::thread::id caller = std::this_thread::get_id();
+  std::mutex mutex;
+  pool->Run(n, [&](size_t i) {
+    ii::ReadCounters start = ii::read_counters;
+    task(i);
+    if (std::this_thread::get_id() != caller) {
+      std::lock_guard lock(mutex);
+      reads.Add(ii::read_counters.Since(start));
+    }
+  });
+}
+
+}  // namespace
+
+sse::SimpleSearchEngine::SimpleSearchEngine(const std::string& directory)
+    : info_directory(directory) {}
+
+bool sse::SimpleSearchEngine::OpenShards() {
+  ii::MappedFile shards;
+  if (!shards.Open(shards_path)) {
+    return false;
+  }
+  ii::Cursor cursor = shards.At(0);
+  size_t count = cursor.ReadVarint();
+  size_t generation = cursor.ReadVarint();
+  if (count == 0) {
+    return false;
+  }
+  N = 0;
+  dl_all = 0;
+  for (size_t i = 0; i < count; ++i) {
+    auto shard = std::make_unique<SimpleSearchEngine>(
+        ii::ShardDirectory(info_directory, i));
+    if (!shard->Open()) {
+      Close();
+      return false;
+    }
+    N += shard->N;
+    dl_all += shard->dl_all;
+    // Quantized impacts are scaled with the statistics of their shard.
+    shard->exact_ = true;
+    shard->exhaustive_ = exhaustive_;
+    shard->posting_cache_.SetCapacity(posting_cache_.Capacity() / count);
+    shards_.push_back(std::move(shard));
+  }
+  for (auto& shard : shards_) {
+    shard->N = N;
+    shard->dl_all = dl_all;
+  }
+  if (generation != generation_) {
+    cache_.Clear();
+    generation_ = generation;
+  }
+  size_t threads = std::min<size_t>(
+      count, std::max(1u, std::thread::hardware_concurrency()));
+  shard_pool_ =
+      threads > 1 ? std::make_unique<ThreadPool>(threads - 1) : nullptr;
+  return true;
+}
+
+bool sse::SimpleSearchEngine::Open() {
+  using Access = ii::MappedFile::Access;
+  stamp_ = StoredStamp();
+  if (std::filesystem::exists(shards_path)) {
+    return OpenShards();
+  }
+  // segments.bin is published last and read first, it bounds the document
+  // tables that updates append to.
+  size_t deltas = 0;
+  codec_ = ii::Codec::Varint;
+  impacts_ = false;
+  ii::DocExtent doc_extent;
+  ii::MappedFile segments;
+  if (segments.Open(segments_path)) {
+    ii::Cursor cursor = segments.At(0);
+    deltas = cursor.ReadVarint();
+    if (!cursor.AtEnd()) {
+      codec_ = static_cast<ii::Codec>(cursor.ReadVarint());
+    }
+    impacts_ = !cursor.AtEnd() && cursor.ReadVarint() != 0;
+    size_t generation = cursor.AtEnd() ? 0 : cursor.ReadVarint();
+    if (generation != generation_) {
+      cache_.Clear();
+      posting_cache_.Clear();
+      generation_ = generation;
+    }
+    if (!cursor.AtEnd()) {
+      doc_extent.size = cursor.ReadVarint();
+      doc_extent.path_bytes = cursor.ReadVarint();
+      doc_extent.line_bytes = cursor.ReadVarint();
+    }
+  }
+  if (!info_file_.Open(info_path, Access::Sequential) ||
+      !doc_table_.Open(doc_info_path, doc_path_path, doc_line_path,
+                       doc_extent)) {
+    return false;
+  }
+  ii::Cursor info = info_file_.At(0);
+  N = info.ReadVarint();
+  dl_all = info.ReadVarint();
+  tombstone_file_.Open(tombstone_path, Access::Random);
+  deleted_ = 0;
+  for (size_t i = 0; i < tombstone_file_.Size(); ++i) {
+    deleted_ += std::popcount(tombstone_file_.Data()[i]);
+  }
+  segments_ = std::vector<IndexSegment>(deltas + 1);
+  for (size_t i = 0; i <= deltas; ++i) {
+    ii::SegmentFiles files(i == 0 ? info_directory
+                                  : ii::DeltaDirectory(info_directory, i));
+    if (!segments_[i].posting_file.Open(files.posting_table_path,
+                                        Access::Random) ||
+        !segments_[i].position_file.Open(files.position_table_path,
+                                         Access::Random) ||
+        !segments_[i].dictionary.Open(files.term_info_path,
+                                      files.term_index_path)) {
+      Close();
+      return false;
+    }
+  }
+  return true;
+}
+
+sse::SimpleSearchEngine::Stamp sse::SimpleSearchEngine::StoredStamp() const {
+  Stamp stamp;
+  struct stat file;
+  stamp.sharded = stat(shards_path.c_str(), &file) == 0;
+  if (stamp.sharded || stat(segments_path.c_str(), &file) == 0) {
+    stamp.inode = file.st_ino;
+    stamp.mtime = file.st_mtim.tv_sec * 1'000'000'000 + file.st_mtim.tv_nsec;
+  }
+  return stamp;
+}
+
+bool sse::SimpleSearchEngine::Changed() const {
+  return StoredStamp() != stamp_;
+}
+
+bool sse::SimpleSearchEngine::IsOpen() const {
+  return info_file_.IsOpen() || !shards_.empty();
+}
+
+void sse::SimpleSearchEngine::Close() {
+  shard_pool_.reset();
+  shards_.clear();
+  segments_.clear();
+  info_file_.Close();
+  tombstone_file_.Close();
+  doc_table_.Close();
+}
+
+sse::TermCursor::TermCursor(ii::Codec codec, bool impacts,
+                            const std::vector<IndexSegment>& segments,
+                            const TermInfo& info,
+                            const ii::MappedFile* tombstones)
+    : tombstones_(tombstones), decoded_(info.postings) {
+  if (decoded_) {
+    return;
+  }
+  for (const auto& [segment, entry] : info.entries) {
+    cursors_.emplace_back(codec,
+                          segments[segment].posting_file.At(entry.posting_ind),
+                          entry.df, impacts);
+    positions_.push_back(
+        segments[segment].position_file.At(entry.position_ind));
+    firsts_.push_back(cursors_.back().DID());
+  }
+  Settle();
+}
+
+bool sse::TermCursor::IsDeleted(const size_t DID) const {
+  return DID / 8 < tombstones_->Size() &&
+         (tombstones_->Data()[DID / 8] & (1 << (DID % 8)));
+}
+
+bool sse::TermCursor::Settle() {
+  while (current_ < cursors_.size()) {
+    if (cursors_[current_].AtEnd()) {
+      ++current_;
+    } else if (IsDeleted(cursors_[current_].DID())) {
+      cursors_[current_].Next();
+    } else {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool sse::TermCursor::Next() {
+  if (decoded_) {
+    return ++index_ < decoded_->DIDs.size();
+  }
+  cursors_[current_].Next();
+  return Settle();
+}
+
+bool sse::TermCursor::Advance(const size_t target) {
+  if (decoded_) {
+    // Gallops from the current posting, targets are usually close.
+    const std::vector<size_t>& DIDs = decoded_->DIDs;
+    if (index_ == DIDs.size() || DIDs[index_] >= target) {
+      return index_ < DIDs.size();
+    }
+    size_t low = index_;
+    size_t step = 1;
+    while (low + step < DIDs.size() && DIDs[low + step] < target) {
+      low += step;
+      step *= 2;
+    }
+    size_t high = std::min(low + step, DIDs.size());
+    index_ = std::lower_bound(DIDs.begin() + low + 1, DIDs.begin() + high,
+                              target) -
+             DIDs.begin();
+    return index_ < DIDs.size();
+  }
+  while (current_ < cursors_.size() && !cursors_[current_].Advance(target)) {
+    ++current_;
+  }
+  return Settle();
+}
+
+void sse::TermCursor::Positions(std::vector<size_t>& positions) const {
+  cursors_[current_].Positions(positions_[current_], positions);
+}
+
+std::vector<std::pair<size_t, ii::SkipEntry>> sse::TermCursor::Blocks()
+    const {
+  if (decoded_) {
+    return decoded_->blocks;
+  }
+  std::vector<std::pair<size_t, ii::SkipEntry>> blocks;
+  for (size_t i = 0; i < cursors_.size(); ++i) {
+    const std::vector<ii::SkipEntry>& skips = cursors_[i].Skips();
+    for (size_t j = 0; j < skips.size(); ++j) {
+      size_t last = SIZE_MAX;
+      if (j + 1 < skips.size()) {
+        last = skips[j + 1].DID;
+      } else if (i + 1 < cursors_.size()) {
+        last = firsts_[i + 1] - 1;
+      }
+      blocks.emplace_back(last, skips[j]);
+    }
+  }
+  return blocks;
+}
+
+sse::TermCursor sse::SimpleSearchEngine::MakeCursor(
+    const TermInfo& info) const {
+  return TermCursor(codec_, impacts_, segments_, info, &tombstone_file_);
+}
+
+sse::TermCursor sse::SimpleSearchEngine::PositionCursor(
+    const TermInfo& info) const {
+  return MakeCursor(TermInfo{info.df, info.entries, nullptr});
+}
+
+std::shared_ptr<const sse::DecodedPostings> sse::SimpleSearchEngine::Decode(
+    const TermInfo& info) const {
+  auto postings = std::make_shared<DecodedPostings>();
+  TermCursor it = MakeCursor(info);
+  postings->blocks = it.Blocks();
+  for (; !it.AtEnd(); it.Next()) {
+    postings->DIDs.push_back(it.DID());
+    postings->tfs.push_back(it.Tf());
+    if (impacts_) {
+      postings->impacts.push_back(it.Impact());
+    }
+  }
+  postings->DIDs.shrink_to_fit();
+  postings->tfs.shrink_to_fit();
+  postings->impacts.shrink_to_fit();
+  return postings;
+}
+
+double sse::SimpleSearchEngine::FindRelevance(const double tf,
+                                              const double df,
+                                              const double dl) const {
+  return ii::Bm25(tf, df, dl, N, (double)dl_all / N);
+}
+
+double sse::SimpleSearchEngine::Score(const TermCursor& it, const size_t df,
+                                      const size_t DID) const {
+  if (impacts_ && !exact_) {
+    return it.Impact();
+  }
+  return FindRelevance(it.Tf(), df, doc_table_.Length(DID));
+}
+
+double sse::SimpleSearchEngine::MaxRelevance(const ii::SkipEntry& block,
+                                             const size_t df) const {
+  if (impacts_ && !exact_) {
+    return block.max_impact;
+  }
+  if (block.max_tf == 0) {
+    return (ii::bm25_k + 1) * std::log2(N / df);
+  }
+  return FindRelevance(block.max_tf, df, block.min_dl);
+}
+
+sse::PhraseNode::PhraseNode(
+    const std::vector<std::shared_ptr<PositionalNode>>& terms)
+    : terms(terms), conjunction(terms[0]) {
+  for (size_t i = 1; i < terms.size(); ++i) {
+    conjunction = std::make_shared<AndNode>(conjunction, terms[i]);
+  }
+  verify();
+}
+
+bool sse::PhraseNode::matches() {
+  terms[0]->positions(starts);
+  for (size_t i = 1; i < terms.size() && !starts.empty(); ++i) {
+    terms[i]->positions(buffer);
+    size_t kept = 0;
+    size_t j = 0;
+    for (size_t start : starts) {
+      while (j < buffer.size() && buffer[j] < start + i) {
+        ++j;
+      }
+      if (j < buffer.size() && buffer[j] == start + i) {
+        starts[kept++] = start;
+      }
+    }
+    starts.resize(kept);
+  }
+  return !starts.empty();
+}
+
+bool sse::NearNode::matches() {
+  left->positions(left_positions);
+  right->positions(right_positions);
+  // Walks both lists moving the earlier span, which can only get closer to
+  // the spans after it.
+  size_t i = 0;
+  size_t j = 0;
+  while (i < left_positions.size() && j < right_positions.size()) {
+    size_t a = left_positions[i];
+    size_t b = right_positions[j];
+    if (a <= b) {
+      if (b < a + left->length() + distance) {
+        return true;
+      }
+      ++i;
+    } else {
+      if (a < b + right->length() + distance) {
+        return true;
+      }
+      ++j;
+    }
+  }
+  return false;
+}
+
+bool sse::TopK::Better(const std::pair<double, size_t>& a,
+                      const std::pair<double, size_t>& b) {
+  return a.first > b.first || (a.first == b.first && a.second < b.second);
+}
+
+void sse::TopK::Push(const double rel, const size_t DID) {
+  ++pushes_;
+  if (heap_.size() < k_) {
+    heap_.emplace_back(rel, DID);
+    std::push_heap(heap_.begin(), heap_.end(), Better);
+  } else if (k_ != 0 && Better(std::make_pair(rel, DID), heap_.front())) {
+    std::pop_heap(heap_.begin(), heap_.end(), Better);
+    heap_.back() = std::make_pair(rel, DID);
+    std::push_heap(heap_.begin(), heap_.end(), Better);
+  }
+}
+
+std::vector<std::pair<double, size_t>> sse::TopK::Sorted() const {
+  std::vector<std::pair<double, size_t>> sorted = heap_;
+  std::sort(sorted.begin(), sorted.end(), std::greater<>());
+  return sorted;
+}
+
+void sse::SimpleSearchEngine::DisjunctiveTopK(
+    const std::set<std::string>& words, const QueryContext& context,
+    const size_t first, const size_t last, TopK& top) const {
+  struct Term {
+    TermCursor cursor;
+    size_t df;
+    size_t last;
+    double bound = 0;
+    std::vector<std::pair<size_t, double>> blocks;
+    size_t block = 0;
+
+    size_t doc() const {
+      return cursor.AtEnd() || cursor.DID() >= last ? Node::end : cursor.DID();
+    }
+  };
+  if (top.Capacity() == 0) {
+    return;
+  }
+  std::vector<Term> terms;
+  for (const auto& word : words) {
+    const TermInfo& info = context.terms.at(word);
+    Term term{MakeCursor(info), info.df, last, 0, {}};
+    term.cursor.Advance(first);
+    for (const auto& [last, block] : term.cursor.Blocks()) {
+      term.blocks.emplace_back(last, MaxRelevance(block, info.df));
+      term.bound = std::max(term.bound, term.blocks.back().second);
+    }
+    terms.push_back(std::move(term));
+  }
+  // Float bounds get a little slack so that rounding never drops a document
+  // the exhaustive ranking would keep. Impact sums are exact.
+  double slack = impacts_ && !exact_ ? 0 : 1e-9;
+  auto beats = [&top, slack](double bound) {
+    return !top.Full() || bound + slack * (1 + bound) > top.Threshold();
+  };
+  std::vector<Term*> order;
+  for (Term& term : terms) {
+    order.push_back(&term);
+  }
+  std::sort(order.begin(), order.end(),
+            [](const Term* a, const Term* b) { return a->doc() < b->doc(); });
+  // Only the cursors in front move on each step, so insertion restores the
+  // DID order in about one pass.
+  auto reorder = [&order]() {
+    for (size_t i = 1; i < order.size(); ++i) {
+      Term* term = order[i];
+      size_t j = i;
+      for (; j > 0 && order[j - 1]->doc() > term->doc(); --j) {
+        order[j] = order[j - 1];
+      }
+      order[j] = term;
+    }
+  };
+  for (;; reorder()) {
+    double bound = 0;
+    size_t pivot = 0;
+    while (pivot < order.size() && order[pivot]->doc() != Node::end) {
+      bound += order[pivot]->bound;
+      if (beats(bound)) {
+        break;
+      }
+      ++pivot;
+    }
+    if (pivot == order.size() || order[pivot]->doc() == Node::end) {
+      break;
+    }
+    size_t DID = order[pivot]->doc();
+    while (pivot + 1 < order.size() && order[pivot + 1]->doc() == DID) {
+      ++pivot;
+    }
+    size_t next = pivot + 1 < order.size() ? order[pivot + 1]->doc() : Node::end;
+    double block_bound = 0;
+    for (size_t i = 0; i <= pivot; ++i) {
+      Term& term = *order[i];
+      while (term.blocks[term.block].first < DID) {
+        ++term.block;
+      }
+      block_bound += term.blocks[term.block].second;
+      next = std::min(next, term.blocks[term.block].first == Node::end
+                                ? Node::end
+                                : term.blocks[term.block].first + 1);
+    }
+    if (!beats(block_bound)) {
+      for (size_t i = 0; i <= pivot; ++i) {
+        order[i]->cursor.Advance(next);
+      }
+    } else if (order[0]->doc() == DID) {
+      double rel = 0;
+      for (Term& term : terms) {
+        if (term.doc() == DID) {
+          rel += Score(term.cursor, term.df, DID);
+        }
+      }
+      top.Push(rel, DID);
+      for (size_t i = 0; i <= pivot; ++i) {
+        order[i]->cursor.Next();
+      }
+    } else {
+      for (size_t i = 0; order[i]->doc() < DID; ++i) {
+        order[i]->cursor.Advance(DID);
+      }
+    }
   }
-  size_t ans = byte;
-  for (int i = bytes.size() - 2; i >= 0; --i) {
-    ans *= 128;
-    ans += bytes[i] - 128;
+}
+
+void sse::SimpleSearchEngine::Rank(std::shared_ptr<Node> expression,
+                                   const std::set<std::string>& words,
+                                   const QueryContext& context,
+                                   const size_t first, const size_t last,
+                                   TopK& top) const {
+  std::vector<TermCursor> scorers;
+  std::vector<size_t> dfs;
+  for (const auto& word : words) {
+    const TermInfo& info = context.terms.at(word);
+    scorers.push_back(MakeCursor(info));
+    dfs.push_back(info.df);
+  }
+  // Scorers form a min-heap on their DIDs. The ones on a match are summed in
+  // word order, the way the pruned evaluation sums them.
+  auto doc = [&scorers](size_t i) {
+    return scorers[i].AtEnd() ? Node::end : scorers[i].DID();
+  };
+  std::vector<std::pair<size_t, size_t>> heap;
+  for (size_t i = 0; i < scorers.size(); ++i) {
+    heap.emplace_back(doc(i), i);
+  }
+  std::make_heap(heap.begin(), heap.end(), std::greater<>());
+  std::vector<size_t> matched;
+  expression->advance(first);
+  for (; expression->doc() < last; expression->next()) {
+    size_t DID = expression->doc();
+    while (!heap.empty() && heap.front().first <= DID) {
+      std::pop_heap(heap.begin(), heap.end(), std::greater<>());
+      size_t i = heap.back().second;
+      if (scorers[i].Advance(DID) && scorers[i].DID() == DID) {
+        matched.push_back(i);
+        heap.pop_back();
+      } else {
+        heap.back().first = doc(i);
+        std::push_heap(heap.begin(), heap.end(), std::greater<>());
+      }
+    }
+    std::sort(matched.begin(), matched.end());
+    double rel = 0;
+    for (size_t i : matched) {
+      rel += Score(scorers[i], dfs[i], DID);
+      scorers[i].Next();
+      heap.emplace_back(doc(i), i);
+      std::push_heap(heap.begin(), heap.end(), std::greater<>());
+    }
+    matched.clear();
+    top.Push(rel, DID);
+  }
+}
+
+std::vector<size_t> sse::SimpleSearchEngine::Partition(
+    const std::set<std::string>& words, const QueryContext& context,
+    const size_t parts) const {
+  std::vector<size_t> ends;
+  for (const auto& word : words) {
+    for (const auto& [last, block] :
+         MakeCursor(context.terms.at(word)).Blocks()) {
+      if (last != Node::end) {
+        ends.push_back(last);
+      }
+    }
+  }
+  std::vector<size_t> bounds{0};
+  if (ends.size() >= parts) {
+    // Blocks hold the same number of postings, but the last of a list.
+    std::sort(ends.begin(), ends.end());
+    for (size_t i = 1; i < parts; ++i) {
+      bounds.push_back(ends[ends.size() * i / parts] + 1);
+    }
+  } else {
+    for (size_t i = 1; i < parts; ++i) {
+      bounds.push_back(doc_table_.Size() * i / parts);
+    }
   }
-  return ans;
+  bounds.push_back(Node::end);
+  bounds.erase(std::unique(bounds.begin(), bounds.end()), bounds.end());
+  return bounds;
 }
 
-double sse::SimpleSearchEngine::FindRelevance(const std::string& term,
-                                              const size_t DID) {
-  double tf = posting_table_[terms_[term].ind][DID];
-  double df = terms_[term].df;
-  double dl = documents_[DID].dl;
-  double dl_avg = (double)dl_all / N;
-  return (tf * (k + 1)) / (tf + k * (1 - b + b * (dl / dl_avg))) *
-         std::log2(N / df);
+void sse::SimpleSearchEngine::SetQueryThreads(size_t threads,
+                                              size_t min_cost) {
+  query_pool_ = threads > 1 ? std::make_unique<ThreadPool>(threads - 1)
+                            : nullptr;
+  parallel_cost_ = min_cost;
+}
+
+void sse::SimpleSearchEngine::SetExhaustive(bool exhaustive) {
+  exhaustive_ = exhaustive;
+  for (auto& shard : shards_) {
+    shard->SetExhaustive(exhaustive);
+  }
+}
+
+void sse::SimpleSearchEngine::SetExact(bool exact) {
+  exact_ = exact;
+  cache_.Clear();
+}
+
+void sse::SimpleSearchEngine::SetCacheSize(size_t size) {
+  cache_.SetCapacity(size);
+}
+
+void sse::SimpleSearchEngine::SetPostingCacheSize(size_t bytes) {
+  posting_cache_.SetCapacity(bytes);
+  for (auto& shard : shards_) {
+    shard->SetPostingCacheSize(bytes / shards_.size());
+  }
+}
+
+const sse::PostingCache& sse::SimpleSearchEngine::Postings() const {
+  return posting_cache_;
+}
+
+size_t sse::SimpleSearchEngine::CacheHits() const {
+  std::lock_guard lock(cache_mutex_);
+  return cache_hits_;
+}
+
+size_t sse::SimpleSearchEngine::CacheMisses() const {
+  std::lock_guard lock(cache_mutex_);
+  return cache_misses_;
+}
+
+size_t sse::SimpleSearchEngine::Generation() const { return generation_; }
+
+void sse::SimpleSearchEngine::SetStatsOutput(std::ostream* out) {
+  stats_out_ = out;
+}
+
+sse::QueryStats sse::SimpleSearchEngine::LastStats() const {
+  std::lock_guard lock(stats_mutex_);
+  return last_stats_;
+}
+
+sse::SessionStats sse::SimpleSearchEngine::Session() const {
+  std::lock_guard lock(stats_mutex_);
+  return session_stats_;
 }
 
 bool sse::SimpleSearchEngine::CheckСorrectness(
     const std::vector<std::string>& request) const {
-  if (request[0] == "AND" || request[0] == "OR") return false;
-  if (request[request.size() - 1] == "AND" ||
-      request[request.size() - 1] == "OR")
-    return false;
+  if (IsOperator(request[0])) return false;
+  if (IsOperator(request[request.size() - 1])) return false;
+  auto leaf = [](const std::string& token) {
+    return token != "(" && token != ")" && !IsOperator(token);
+  };
+  for (const auto& token : request) {
+    if (token[0] == '"' && !IsPhrase(token)) {
+      return false;
+    }
+  }
   size_t open_bracket = 0;
   size_t close_bracket = 0;
   for (int i = 0; i < request.size() - 1; ++i) {
@@ -40,20 +704,26 @@ bool sse::SimpleSearchEngine::CheckСorrectness(
     std::string next = request[i + 1];
     if (cur == "(") {
       ++open_bracket;
-      if (next == "AND" || next == "OR") {
+      if (IsOperator(next)) {
         return false;
       }
     } else if (cur == ")") {
       ++close_bracket;
-      if (!(next == "AND" || next == "OR" || next == ")")) {
+      if (!(IsOperator(next) || next == ")")) {
+        return false;
+      }
+    } else if (IsOperator(cur)) {
+      if (IsOperator(next) || next == ")") {
         return false;
       }
-    } else if (cur == "AND" || cur == "OR") {
-      if (next == "AND" || next == "OR" || next == ")") {
+      // NEAR joins two words or phrases and does not chain.
+      if (IsNear(cur) &&
+          (!leaf(request[i - 1]) || !leaf(next) ||
+           (i + 2 < request.size() && IsNear(request[i + 2])))) {
         return false;
       }
     } else {
-      if (!(next == "AND" || next == "OR" || next == ")")) {
+      if (!(IsOperator(next) || next == ")")) {
         return false;
       }
     }
@@ -69,7 +739,7 @@ bool sse::SimpleSearchEngine::CheckСorrectness(
 
 std::shared_ptr<sse::Node> sse::SimpleSearchEngine::ParseExpression(
     const std::vector<std::string>& expression, const size_t start,
-    const size_t end) {
+    const size_t end, const QueryContext& context) const {
   std::stack<std::shared_ptr<Node>> operands;
   std::stack<std::string> operators;
   for (int i = start; i < end; ++i) {
@@ -84,9 +754,9 @@ std::shared_ptr<sse::Node> sse::SimpleSearchEngine::ParseExpression(
         }
         j++;
       }
-      operands.push(ParseExpression(expression, i + 1, j - 1));
+      operands.push(ParseExpression(expression, i + 1, j - 1, context));
       i = j - 1;
-    } else if (expression[i] == "AND" || expression[i] == "OR") {
+    } else if (IsOperator(expression[i])) {
       operators.push(expression[i]);
     } else if (expression[i] == ")") {
       while (!operators.empty()) {
@@ -103,13 +773,24 @@ std::shared_ptr<sse::Node> sse::SimpleSearchEngine::ParseExpression(
         }
       }
     } else {
-      std::set<size_t> s;
-      std::map<size_t, size_t> posting_list =
-          posting_table_[terms_[expression[i]].ind];
-      for (auto it = posting_list.begin(); it != posting_list.end(); ++it) {
-        s.insert(it->first);
+      bool positional = (i > start && IsNear(expression[i - 1])) ||
+                        (i + 1 < end && IsNear(expression[i + 1]));
+      operands.push(MakeOperand(expression[i], positional, context));
+      // NEAR binds its operands right away.
+      size_t distance;
+      if (!operators.empty() && IsNear(operators.top(), &distance)) {
+        operators.pop();
+        auto right =
+            std::dynamic_pointer_cast<PositionalNode>(operands.top());
+        operands.pop();
+        auto left = std::dynamic_pointer_cast<PositionalNode>(operands.top());
+        operands.pop();
+        if (left && right) {
+          operands.push(std::make_shared<NearNode>(left, right, distance));
+        } else {
+          operands.push(std::make_shared<EmptyNode>());
+        }
       }
-      operands.push(std::make_shared<TermNode>(s));
     }
   }
   while (!operators.empty()) {
@@ -128,218 +809,532 @@ std::shared_ptr<sse::Node> sse::SimpleSearchEngine::ParseExpression(
   return operands.top();
 }
 
-std::vector<std::string> sse::SimpleSearchEngine::SplitRequest(
-    std::string& request) const {
-  std::regex reg("\\w+|\\S");
-  std::smatch match;
-  std::vector<std::string> exp;
-  while (std::regex_search(request, match, reg)) {
-    std::string token = match.str();
-    exp.push_back(token);
-    request = match.suffix();
+std::shared_ptr<sse::Node> sse::SimpleSearchEngine::MakeOperand(
+    const std::string& token, bool positional,
+    const QueryContext& context) const {
+  std::vector<std::string> words{token};
+  if (IsPhrase(token)) {
+    words = PhraseTerms(token);
+    positional = positional || words.size() > 1;
   }
-  return exp;
+  std::vector<std::shared_ptr<PositionalNode>> nodes;
+  for (const auto& word : words) {
+    auto term = context.terms.find(word);
+    if (term == context.terms.end()) {
+      return std::make_shared<EmptyNode>();
+    }
+    nodes.push_back(std::make_shared<TermNode>(
+        positional ? PositionCursor(term->second) : MakeCursor(term->second),
+        term->second.df));
+  }
+  if (nodes.size() == 1) {
+    return nodes[0];
+  }
+  return std::make_shared<PhraseNode>(nodes);
 }
 
-void sse::SimpleSearchEngine::GetInfo(const std::set<std::string>& words) {
-  std::ifstream term_info(term_info_path, std::ios::binary);
-  std::ifstream posting_table(posting_table_path, std::ios::binary);
-  while (!term_info.eof()) {
-    size_t term_size = Read(term_info);
-    if (term_info.eof()) {
-      break;
+namespace {
+
+// Query in canonical form: operands of chained equal operators are pulled
+// into one node, sorted and deduplicated, so equivalent queries render the
+// same.
+struct CanonicalNode {
+  std::string op;
+  std::vector<std::string> operands;
+};
+
+std::string Render(CanonicalNode node) {
+  if (node.op.empty()) {
+    return node.operands.empty() ? "" : node.operands[0];
+  }
+  std::sort(node.operands.begin(), node.operands.end());
+  node.operands.erase(std::unique(node.operands.begin(), node.operands.end()),
+                      node.operands.end());
+  if (node.operands.size() == 1) {
+    return node.operands[0];
+  }
+  std::string text = "(" + node.operands[0];
+  for (size_t i = 1; i < node.operands.size(); ++i) {
+    text += " " + node.op + " " + node.operands[i];
+  }
+  return text + ")";
+}
+
+CanonicalNode Combine(const std::string& op, const CanonicalNode& left,
+                      const CanonicalNode& right) {
+  CanonicalNode node{op, {}};
+  for (const CanonicalNode* side : {&left, &right}) {
+    if (side->op == op) {
+      node.operands.insert(node.operands.end(), side->operands.begin(),
+                           side->operands.end());
+    } else {
+      node.operands.push_back(Render(*side));
     }
-    std::string term = "";
-    for (int i = 0; i < term_size; ++i) {
-      char byte;
-      term_info.read(reinterpret_cast<char*>(&byte), 1);
-      term += byte;
-    }
-    size_t posting_list_size = Read(term_info);
-    size_t posting_ind = Read(term_info);
-    size_t position_ind = Read(term_info);
-    if (words.contains(term)) {
-      posting_table.seekg(posting_ind);
-      if (!terms_.contains(term)) {
-        terms_[term] = TermInfo(terms_.size());
-        std::map<size_t, size_t> posting_list;
-        size_t prev = 0;
-        for (int i = 0; i < posting_list_size; ++i) {
-          size_t DID = Read(posting_table) + prev;
-          prev = DID;
-          size_t tf = Read(posting_table);
-          posting_list[DID] = tf;
-        }
-        posting_table_.push_back(posting_list);
-      } else {
-        size_t ind = terms_[term].ind;
-        size_t prev = 0;
-        for (int i = 0; i < posting_list_size; ++i) {
-          size_t DID = Read(posting_table) + prev;
-          prev = DID;
-          size_t tf = Read(posting_table);
-          if (!posting_table_[ind].contains(DID)) {
-            posting_table_[ind][DID] = tf;
-          } else {
-            posting_table_[ind][DID] += tf;
-          }
+  }
+  return node;
+}
+
+// Mirrors the grouping of ParseExpression.
+CanonicalNode Canonicalize(const std::vector<std::string>& expression,
+                           const size_t start, const size_t end) {
+  std::vector<CanonicalNode> operands;
+  std::vector<std::string> operators;
+  for (size_t i = start; i < end; ++i) {
+    if (expression[i] == "(") {
+      size_t j = i + 1;
+      for (int brackets = 1; brackets > 0; ++j) {
+        if (expression[j] == "(") {
+          ++brackets;
+        } else if (expression[j] == ")") {
+          --brackets;
         }
       }
-      terms_[term].size.emplace_back(posting_list_size);
-      terms_[term].pos.emplace_back(std::make_pair(posting_ind, position_ind));
-      terms_[term].df = posting_table_[terms_[term].ind].size();
+      operands.push_back(Canonicalize(expression, i + 1, j - 1));
+      i = j - 1;
+    } else if (IsOperator(expression[i])) {
+      operators.push_back(expression[i]);
+    } else if (expression[i] != ")") {
+      operands.push_back(CanonicalNode{"", {expression[i]}});
+      if (!operators.empty() && IsNear(operators.back())) {
+        CanonicalNode right = operands.back();
+        operands.pop_back();
+        operands.back() = Combine(operators.back(), operands.back(), right);
+        operators.pop_back();
+      }
     }
   }
-  term_info.close();
-  posting_table.close();
+  if (operands.empty()) {
+    return CanonicalNode{};
+  }
+  while (!operators.empty() && operands.size() > 1) {
+    CanonicalNode right = operands.back();
+    operands.pop_back();
+    operands.back() = Combine(operators.back(), operands.back(), right);
+    operators.pop_back();
+  }
+  return operands.back();
 }
 
-void sse::SimpleSearchEngine::GetDocs(const std::set<std::size_t>& docs) {
-  std::ifstream doc_info(doc_info_path, std::ios::binary);
-  while (!doc_info.eof()) {
-    size_t DID = Read(doc_info);
-    if (doc_info.eof()) {
-      break;
+}  // namespace
+
+std::string sse::SimpleSearchEngine::CanonicalQuery(
+    const std::vector<std::string>& expression) const {
+  return Render(Canonicalize(expression, 0, expression.size()));
+}
+
+std::vector<std::string> sse::SimpleSearchEngine::SplitRequest(
+    std::string& request) const {
+  // Runs of word characters, quoted phrases, NEAR/n or any other single
+  // non-space character.
+  auto word = [](unsigned char c) { return std::isalnum(c) || c == '_'; };
+  std::vector<std::string> exp;
+  for (size_t i = 0; i < request.size();) {
+    if (std::isspace(static_cast<unsigned char>(request[i]))) {
+      ++i;
+      continue;
     }
-    size_t dl = Read(doc_info);
-    size_t path_size = Read(doc_info);
-    std::string path = "";
-    for (int i = 0; i < path_size; ++i) {
-      char byte;
-      doc_info.read(reinterpret_cast<char*>(&byte), 1);
-      path += byte;
-    }
-    if (docs.contains(DID)) {
-      documents_[DID] = DocInfo(dl, path);
-    }
-  }
-}
-
-void sse::SimpleSearchEngine::GetLines(const std::set<size_t>& docs) {
-  std::ifstream posting_table(posting_table_path, std::ios::binary);
-  std::ifstream position_table(position_table_path, std::ios::binary);
-  for (auto it = terms_.begin(); it != terms_.end(); ++it) {
-    for (int i = 0; i < it->second.pos.size(); ++i) {
-      size_t posting_list_size = it->second.size[i];
-      size_t posting_ind = it->second.pos[i].first;
-      size_t position_ind = it->second.pos[i].second;
-      posting_table.seekg(posting_ind);
-      position_table.seekg(position_ind);
-      size_t prev_DID = 0;
-      for (int j = 0; j < posting_list_size; ++j) {
-        size_t DID = Read(posting_table) + prev_DID;
-        prev_DID = DID;
-        size_t position_list_size = Read(posting_table);
-        if (!docs.contains(DID)) {
-          for (int k = 0; k < position_list_size; ++k) {
-            Read(position_table);
-          }
-        } else {
-          size_t prev_line = 0;
-          for (int k = 0; k < position_list_size; ++k) {
-            size_t line = Read(position_table) + prev_line;
-            prev_line = line;
-            position_table_[DID].push_back(line);
-          }
+    size_t j = i + 1;
+    if (word(request[i])) {
+      while (j < request.size() && word(request[j])) {
+        ++j;
+      }
+      if (request.compare(i, j - i, "NEAR") == 0 && j + 1 < request.size() &&
+          request[j] == '/' && std::isdigit(request[j + 1])) {
+        for (++j; j < request.size() && std::isdigit(request[j]); ++j) {
         }
       }
+    } else if (request[i] == '"' && request.find('"', j) != std::string::npos) {
+      j = request.find('"', j) + 1;
+    }
+    exp.push_back(request.substr(i, j - i));
+    i = j;
+  }
+  return exp;
+}
+
+void sse::SimpleSearchEngine::GetInfo(const std::set<std::string>& words,
+                                      QueryContext& context) {
+  ii::TermEntry entry;
+  for (const auto& word : words) {
+    TermInfo info;
+    for (size_t i = 0; i < segments_.size(); ++i) {
+      if (segments_[i].dictionary.Find(word, entry)) {
+        info.entries.emplace_back(i, entry);
+        info.df += entry.df;
+      }
+    }
+    bool admitted;
+    {
+      std::lock_guard lock(posting_mutex_);
+      info.postings = posting_cache_.Find(word);
+      admitted = !info.postings && info.df != 0 && posting_cache_.Admits(word);
+    }
+    // Threads asking for the same term at once may both decode it, the
+    // later insert is dropped.
+    if (admitted) {
+      info.postings = Decode(info);
+      std::lock_guard lock(posting_mutex_);
+      posting_cache_.Insert(word, info.postings);
+    }
+    // The dictionary df still counts deleted documents until compaction
+    // drops them, so no request walks a posting list to count them out. Only
+    // a term left in deleted documents alone is not found.
+    if (info.postings ? info.postings->DIDs.empty()
+                      : deleted_ != 0 && info.df != 0 &&
+                            MakeCursor(info).AtEnd()) {
+      info.df = 0;
+    }
+    info.df = std::min(info.df, static_cast<size_t>(N));
+    if (info.df != 0) {
+      context.terms.emplace(word, std::move(info));
+    }
+  }
+}
+
+void sse::SimpleSearchEngine::GetLines(const std::set<size_t>& docs,
+                                       QueryContext& context) const {
+  for (const auto& [word, info] : context.terms) {
+    TermCursor it = PositionCursor(info);
+    for (size_t DID : docs) {
+      if (!it.Advance(DID)) {
+        break;
+      }
+      if (it.DID() == DID) {
+        it.Positions(context.lines[DID]);
+      }
     }
   }
-  for (auto it = position_table_.begin(); it != position_table_.end(); ++it) {
-    std::sort((it->second).begin(), (it->second).end());
+  for (auto& [DID, positions] : context.lines) {
+    std::sort(positions.begin(), positions.end());
+    positions = doc_table_.Lines(DID, positions);
   }
-  posting_table.close();
-  position_table.close();
 }
 
-void sse::SimpleSearchEngine::Request(std::string& request, const size_t k) {
-  std::ifstream info(info_path, std::ios::binary);
-  N = Read(info);
-  dl_all = Read(info);
-  info.close();
+void sse::SimpleSearchEngine::Request(std::string& request, const size_t k,
+                                      std::ostream& out, std::ostream& err) {
+  auto start = Clock::now();
+  ii::ReadCounters reads = ii::read_counters;
+  QueryContext context;
+  context.stats.query = request;
+  context.stats.k = k;
   std::vector<std::string> exp = SplitRequest(request);
   std::set<std::string> words;
   for (int i = 0; i < exp.size(); ++i) {
-    if (exp[i] != "{" && exp[i] != "}" && exp[i] != "AND" && exp[i] != "OR") {
+    if (IsPhrase(exp[i])) {
+      std::vector<std::string> terms = PhraseTerms(exp[i]);
+      std::string phrase;
+      for (const auto& term : terms) {
+        phrase += (phrase.empty() ? "" : " ") + term;
+        words.insert(term);
+      }
+      exp[i] = '"' + phrase + '"';
+    } else if (exp[i] != "(" && exp[i] != ")" && !IsOperator(exp[i])) {
+      std::transform(exp[i].begin(), exp[i].end(), exp[i].begin(), ::tolower);
       words.insert(exp[i]);
     }
   }
-  if (!CheckСorrectness(exp)) {
-    std::cerr << "Invalid request\n";
+  if (exp.empty() || !CheckСorrectness(exp)) {
+    err << "Invalid request\n";
+    return;
+  }
+  std::shared_lock index_lock(open_mutex_);
+  if (!IsOpen() || Changed()) {
+    index_lock.unlock();
+    {
+      std::unique_lock lock(open_mutex_);
+      if (IsOpen() && Changed()) {
+        // A generation may repeat when a single index replaces a sharded
+        // one, so the caches are dropped here and not only by Open().
+        Close();
+        cache_.Clear();
+        posting_cache_.Clear();
+      }
+      if (!IsOpen() && !Open()) {
+        err << "Index not found\n";
+        return;
+      }
+    }
+    index_lock.lock();
+  }
+  QueryStats& stats = context.stats;
+  std::string key = CanonicalQuery(exp) + '\n' + std::to_string(k);
+  stats.terms = words.size();
+  stats.parse = Seconds(start, Clock::now());
+  std::string result;
+  {
+    std::lock_guard lock(cache_mutex_);
+    if (const std::string* cached = cache_.Find(key)) {
+      ++cache_hits_;
+      stats.cached = true;
+      result = *cached;
+    } else {
+      ++cache_misses_;
+    }
+  }
+  if (!stats.cached) {
+    std::ostringstream rendered;
+    Search(exp, words, k, context, rendered);
+    result = rendered.str();
+    std::lock_guard lock(cache_mutex_);
+    cache_.Insert(key, result);
+  }
+  index_lock.unlock();
+  out << result;
+  stats.total = Seconds(start, Clock::now());
+  stats.reads.Add(ii::read_counters.Since(reads));
+  std::lock_guard lock(stats_mutex_);
+  last_stats_ = stats;
+  session_stats_.Add(stats);
+  if (stats_out_) {
+    stats.Write(*stats_out_);
+    *stats_out_ << std::endl;
+  }
+}
+
+void sse::SimpleSearchEngine::Search(const std::vector<std::string>& exp,
+                                     std::set<std::string>& words,
+                                     const size_t k, QueryContext& context,
+                                     std::ostream& out) {
+  if (!shards_.empty()) {
+    SearchShards(exp, words, k, context, out);
     return;
   }
-  GetInfo(words);
+  auto start = Clock::now();
+  QueryStats& stats = context.stats;
+  GetInfo(words, context);
   std::set<std::string> correct_words;
   for (auto it = words.begin(); it != words.end(); ++it) {
-    if (terms_.contains(*it)) {
+    if (context.terms.contains(*it)) {
       correct_words.insert(*it);
+      stats.postings += context.terms.at(*it).df;
     }
   }
+  stats.found_terms = correct_words.size();
+  auto looked_up = Clock::now();
+  stats.lookup = Seconds(start, looked_up);
   if (correct_words.size() == 0) {
-    std::cout << "No matching files\n";
+    out << "No matching files\n";
     return;
   }
   words = correct_words;
-  std::shared_ptr<Node> expression = ParseExpression(exp, 0, exp.size());
-  std::set<size_t> docs = expression->calculate();
-  GetDocs(docs);
-  std::vector<PostingIterator> its;
-  for (auto i = words.begin(); i != words.end(); ++i) {
-    auto it1 = posting_table_[terms_[*i].ind].begin();
-    auto it2 = posting_table_[terms_[*i].ind].end();
-    while (it1 != it2 && !docs.contains(it1->first)) {
-      ++it1;
-    }
-    if (it1 != it2) {
-      its.emplace_back(PostingIterator(it1, it2, *i));
-    }
-  }
-  std::multimap<double, size_t> ans;
-  while (!its.empty()) {
-    sort(its.begin(), its.end(), [](PostingIterator it1, PostingIterator it2) {
-      return it1.it1->first < it2.it1->first;
-    });
-    size_t DID = its[0].it1->first;
-    double rel = 0;
-    for (int i = 0; i < its.size(); ++i) {
-      if (its[i].it1->first == DID) {
-        rel += FindRelevance(its[i].term, DID);
-        ++its[i].it1;
-        while (its[i].it1 != its[i].it2 && !docs.contains(its[i].it1->first)) {
-          ++its[i].it1;
-        }
-      }
+  std::vector<std::pair<double, size_t>> ans =
+      Evaluate(exp, words, k, context);
+  auto evaluated = Clock::now();
+  stats.evaluate = Seconds(looked_up, evaluated);
+  stats.results = ans.size();
+  std::set<size_t> DIDs;
+  for (const auto& [rel, DID] : ans) {
+    DIDs.insert(DID);
+  }
+  GetLines(DIDs, context);
+  for (const auto& [rel, DID] : ans) {
+    out << doc_table_.Path(DID) << ' ';
+    for (size_t line : context.lines[DID]) {
+      out << line << ' ';
     }
-    if (ans.size() < k) {
-      ans.insert(std::make_pair(rel, DID));
+    out << '\n';
+  }
+  stats.lines = Seconds(evaluated, Clock::now());
+}
+
+std::vector<std::pair<double, size_t>> sse::SimpleSearchEngine::Evaluate(
+    const std::vector<std::string>& exp, const std::set<std::string>& words,
+    const size_t k, QueryContext& context) const {
+  QueryStats& stats = context.stats;
+  bool disjunction =
+      std::none_of(exp.begin(), exp.end(), [](const std::string& token) {
+        return token == "AND" || IsNear(token) || IsPhrase(token);
+      });
+  bool pruned = !exhaustive_ && disjunction;
+  std::shared_ptr<Node> expression;
+  size_t cost = 0;
+  for (const auto& word : words) {
+    cost += context.terms.at(word).df;
+  }
+  if (!pruned) {
+    expression = ParseExpression(exp, 0, exp.size(), context);
+    cost = expression->cost();
+  }
+  auto evaluate = [&](std::shared_ptr<Node> node, size_t first, size_t last,
+                      TopK& top) {
+    if (pruned) {
+      DisjunctiveTopK(words, context, first, last, top);
     } else {
-      auto it = ans.begin();
-      if (it->first < rel) {
-        ans.erase(it);
-        ans.insert(std::make_pair(rel, DID));
+      Rank(node, words, context, first, last, top);
+    }
+  };
+  TopK top(k);
+  if (!query_pool_ || cost < parallel_cost_) {
+    evaluate(expression, 0, Node::end, top);
+    stats.scored = top.Pushes();
+  } else {
+    // Every range keeps its own top-k, the best k of their union are those
+    // of one pass over all DIDs.
+    std::vector<size_t> bounds =
+        Partition(words, context, query_pool_->Size() + 1);
+    std::vector<TopK> tops(bounds.size() - 1, TopK(k));
+    Parallel(
+        query_pool_.get(), tops.size(),
+        [&](size_t i) {
+          evaluate(i == 0 || pruned
+                       ? expression
+                       : ParseExpression(exp, 0, exp.size(), context),
+                   bounds[i], bounds[i + 1], tops[i]);
+        },
+        stats.reads);
+    for (const TopK& range : tops) {
+      for (const auto& [rel, DID] : range.Sorted()) {
+        top.Push(rel, DID);
       }
+      stats.scored += range.Pushes();
     }
-    its.erase(
-        std::remove_if(its.begin(), its.end(),
-                       [](PostingIterator it) { return it.it1 == it.it2; }),
-        its.end());
   }
-  std::set<size_t> DIDs;
-  for (auto it = ans.begin(); it != ans.end(); ++it) {
-    DIDs.insert(it->second);
+  return top.Sorted();
+}
+
+void sse::SimpleSearchEngine::SearchShards(
+    const std::vector<std::string>& exp, const std::set<std::string>& words,
+    const size_t k, QueryContext& context, std::ostream& out) {
+  auto start = Clock::now();
+  QueryStats& stats = context.stats;
+  std::vector<QueryContext> contexts(shards_.size());
+  Parallel(
+      shard_pool_.get(), shards_.size(),
+      [&](size_t i) { shards_[i]->GetInfo(words, contexts[i]); },
+      stats.reads);
+  // Every shard scores with the df of the whole index, so scores compare
+  // across shards and match those of a single index.
+  std::map<std::string, size_t> df;
+  for (const QueryContext& shard : contexts) {
+    for (const auto& [word, info] : shard.terms) {
+      df[word] += info.df;
+    }
+  }
+  for (QueryContext& shard : contexts) {
+    for (auto& [word, info] : shard.terms) {
+      info.df = df[word];
+    }
+  }
+  for (const auto& [word, postings] : df) {
+    stats.postings += postings;
+  }
+  stats.found_terms = df.size();
+  auto looked_up = Clock::now();
+  stats.lookup = Seconds(start, looked_up);
+  if (df.empty()) {
+    out << "No matching files\n";
+    return;
+  }
+  std::vector<std::vector<std::pair<double, size_t>>> tops(shards_.size());
+  Parallel(
+      shard_pool_.get(), shards_.size(),
+      [&](size_t i) {
+        std::set<std::string> found;
+        for (const auto& [word, info] : contexts[i].terms) {
+          found.insert(word);
+        }
+        if (!found.empty()) {
+          tops[i] = shards_[i]->Evaluate(exp, found, k, contexts[i]);
+        }
+      },
+      stats.reads);
+  struct Hit {
+    double rel;
+    size_t shard;
+    size_t DID;
+    std::string_view path;
+  };
+  std::vector<Hit> hits;
+  for (size_t i = 0; i < shards_.size(); ++i) {
+    for (const auto& [rel, DID] : tops[i]) {
+      hits.push_back(Hit{rel, i, DID, shards_[i]->doc_table_.Path(DID)});
+    }
+    stats.scored += contexts[i].stats.scored;
   }
-  GetLines(DIDs);
-  for (auto it = ans.end(); it != ans.begin();) {
-    --it;
-    std::cout << documents_[it->second].path << ' ';
-    for (int i = 0; i != position_table_[it->second].size(); ++i) {
-      std::cout << position_table_[it->second][i] << ' ';
+  // A single index keeps the lower DID, that is the lower path, on ties and
+  // lists tied results by descending DID. An update gives the files it
+  // indexes new DIDs past the others, so once the index is updated its ties
+  // may list, and at the cut-off keep, other documents than the paths do
+  // here. The documents and their scores stay the same.
+  std::sort(hits.begin(), hits.end(), [](const Hit& lhs, const Hit& rhs) {
+    return lhs.rel != rhs.rel ? lhs.rel > rhs.rel : lhs.path < rhs.path;
+  });
+  hits.resize(std::min(hits.size(), k));
+  std::sort(hits.begin(), hits.end(), [](const Hit& lhs, const Hit& rhs) {
+    return lhs.rel != rhs.rel ? lhs.rel > rhs.rel : lhs.path > rhs.path;
+  });
+  auto evaluated = Clock::now();
+  stats.evaluate = Seconds(looked_up, evaluated);
+  stats.results = hits.size();
+  std::vector<std::set<size_t>> DIDs(shards_.size());
+  for (const Hit& hit : hits) {
+    DIDs[hit.shard].insert(hit.DID);
+  }
+  Parallel(
+      shard_pool_.get(), shards_.size(),
+      [&](size_t i) {
+        if (!DIDs[i].empty()) {
+          shards_[i]->GetLines(DIDs[i], contexts[i]);
+        }
+      },
+      stats.reads);
+  for (const Hit& hit : hits) {
+    out << hit.path << ' ';
+    for (size_t line : contexts[hit.shard].lines[hit.DID]) {
+      out << line << ' ';
     }
-    std::cout << '\n';
+    out << '\n';
   }
+  stats.lines = Seconds(evaluated, Clock::now());
+}
+
+void sse::SimpleSearchEngine::Serve(std::istream& in, std::ostream& out,
+                                    std::ostream& err) {
+  std::string line;
+  std::string request;
+  while (std::getline(in, line) && std::getline(in, request)) {
+    size_t k;
+    try {
+      k = std::stoull(line);
+    } catch (const std::logic_error& e) {
+      err << "Invalid argument\n";
+      continue;
+    }
+    Request(request, k, out, err);
+    out << std::endl;
+  }
+}
 
-  documents_.clear();
-  terms_.clear();
-  posting_table_.clear();
-  position_table_.clear();
-}
\ No newline at end of file
+void sse::SimpleSearchEngine::Batch(
+    std::vector<std::pair<size_t, std::string>> requests, const size_t threads,
+    std::ostream& out, std::ostream& err) {
+  struct Result {
+    std::string out;
+    std::string err;
+    bool done = false;
+  };
+  std::vector<Result> results(requests.size());
+  std::mutex mutex;
+  std::condition_variable finished;
+  ThreadPool pool(threads);
+  for (size_t i = 0; i < requests.size(); ++i) {
+    pool.Submit([this, i, &requests, &results, &mutex, &finished]() {
+      std::ostringstream result;
+      std::ostringstream error;
+      Request(requests[i].second, requests[i].first, result, error);
+      std::lock_guard lock(mutex);
+      results[i] = Result{result.str(), error.str(), true};
+      finished.notify_one();
+    });
+  }
+  // Results are printed as soon as all earlier ones are, so the output
+  // streams while later requests still run.
+  for (Result& result : results) {
+    std::unique_lock lock(mutex);
+    finished.wait(lock, [&result]() { return result.done; });
+    lock.unlock();
+    out << result.out;
+    err << result.err;
+    result = Result{};
+  }
+}
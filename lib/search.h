@@ -1,128 +1,551 @@
 #pragma once
 
+#include <bit>
 #include <iostream>
+#include <mutex>
+#include <shared_mutex>
 
 #include "index.h"
+#include "lru_cache.h"
+#include "posting_cache.h"
+#include "query_stats.h"
+#include "thread_pool.h"
 
 namespace sse {
 
-struct DocInfo {
-  size_t dl;
-  std::string path;
-  DocInfo(size_t dl, const std::string& path) : dl(dl), path(path) {}
-  DocInfo() = default;
+struct TermInfo {
+  size_t df = 0;
+  std::vector<std::pair<size_t, ii::TermEntry>> entries;
+  std::shared_ptr<const DecodedPostings> postings;
 };
 
-struct TermInfo {
-  size_t ind;
-  size_t df;
-  std::vector<size_t> size;
-  std::vector<std::pair<size_t, size_t>> pos;
-  TermInfo(size_t ind) : ind(ind) {}
-  TermInfo() = default;
+struct IndexSegment {
+  ii::Dictionary dictionary;
+  ii::MappedFile posting_file;
+  ii::MappedFile position_file;
 };
 
+// Postings of one term over all segments in DID order. Segments hold
+// ascending DID ranges, so the cursor walks them one after another and drops
+// deleted documents on the way. When the term carries decoded postings the
+// cursor walks those instead, and has no positions.
+class TermCursor {
+  std::vector<ii::PostingCursor> cursors_;
+  std::vector<ii::Cursor> positions_;
+  std::vector<size_t> firsts_;
+  const ii::MappedFile* tombstones_;
+  size_t current_ = 0;
+  std::shared_ptr<const DecodedPostings> decoded_;
+  size_t index_ = 0;
+
+  bool IsDeleted(const size_t DID) const;
+
+  bool Settle();
+
+ public:
+  TermCursor(ii::Codec codec, bool impacts,
+             const std::vector<IndexSegment>& segments,
+             const TermInfo& info, const ii::MappedFile* tombstones);
+
+  bool AtEnd() const {
+    return decoded_ ? index_ == decoded_->DIDs.size()
+                    : current_ == cursors_.size();
+  }
+
+  size_t DID() const {
+    return decoded_ ? decoded_->DIDs[index_] : cursors_[current_].DID();
+  }
+
+  size_t Tf() const {
+    return decoded_ ? decoded_->tfs[index_] : cursors_[current_].Tf();
+  }
+
+  uint8_t Impact() const {
+    return decoded_ ? decoded_->impacts[index_] : cursors_[current_].Impact();
+  }
+
+  bool Next();
+
+  bool Advance(const size_t target);
+
+  void Positions(std::vector<size_t>& positions) const;
+
+  // Every block of the term in DID order with the last DID it may hold.
+  std::vector<std::pair<size_t, ii::SkipEntry>> Blocks() const;
+};
+
+// Query nodes are cursors over matching documents in ascending DID order, so
+// a query is matched and scored in one pass without materializing results.
+// A finished node sits on end.
 class Node {
  public:
-  virtual std::set<size_t> calculate() const = 0;
+  static constexpr size_t end = SIZE_MAX;
+
+  virtual size_t doc() const = 0;
+
+  virtual void next() = 0;
+
+  // Moves to the first match with DID >= target.
+  virtual void advance(size_t target) = 0;
+
+  // Upper bound of the number of matching documents.
+  virtual size_t cost() const = 0;
+};
+
+// Node whose matches are spans of tokens.
+class PositionalNode : public Node {
+ public:
+  // Ascending start positions of the spans in the current document.
+  virtual void positions(std::vector<size_t>& out) = 0;
+
+  // Number of tokens in a span.
+  virtual size_t length() const = 0;
 };
 
-class TermNode : public Node {
+class TermNode : public PositionalNode {
  public:
-  TermNode(const std::set<size_t>& value) : value(value) {}
-  virtual std::set<size_t> calculate() const override { return value; }
+  TermNode(const TermCursor& cursor, size_t df) : cursor(cursor), df(df) {}
+
+  virtual size_t doc() const override {
+    return cursor.AtEnd() ? end : cursor.DID();
+  }
+
+  virtual void next() override { cursor.Next(); }
+
+  virtual void advance(size_t target) override { cursor.Advance(target); }
+
+  virtual size_t cost() const override { return df; }
+
+  virtual void positions(std::vector<size_t>& out) override {
+    out.clear();
+    cursor.Positions(out);
+  }
+
+  virtual size_t length() const override { return 1; }
 
  private:
-  const std::set<size_t> value;
+  TermCursor cursor;
+  const size_t df;
+};
+
+class EmptyNode : public Node {
+ public:
+  virtual size_t doc() const override { return end; }
+
+  virtual void next() override {}
+
+  virtual void advance(size_t) override {}
+
+  virtual size_t cost() const override { return 0; }
 };
 
+// The cheaper child leads, the other one is only advanced to its candidates.
 class AndNode : public Node {
  public:
   AndNode(std::shared_ptr<Node> left, std::shared_ptr<Node> right)
-      : left(left), right(right) {}
+      : left(left->cost() <= right->cost() ? left : right),
+        right(left->cost() <= right->cost() ? right : left) {
+    align();
+  }
+
+  virtual size_t doc() const override { return left->doc(); }
+
+  virtual void next() override {
+    left->next();
+    align();
+  }
 
-  virtual std::set<size_t> calculate() const override {
-    std::set<size_t> s;
-    std::set<size_t> s1 = left->calculate();
-    std::set<size_t> s2 = right->calculate();
-    std::set_intersection(s1.begin(), s1.end(), s2.begin(), s2.end(),
-                          std::inserter(s, s.begin()));
-    return s;
+  virtual void advance(size_t target) override {
+    left->advance(target);
+    align();
   }
 
+  virtual size_t cost() const override { return left->cost(); }
+
  private:
   std::shared_ptr<Node> left;
   std::shared_ptr<Node> right;
+
+  void align() {
+    while (left->doc() != end) {
+      right->advance(left->doc());
+      if (right->doc() == left->doc()) {
+        return;
+      }
+      left->advance(right->doc());
+    }
+  }
 };
 
+// Chains of ORs collapse into one node that keeps its children in a min-heap
+// on their cached DIDs, so a step costs O(log n) instead of a walk down the
+// chain.
 class OrNode : public Node {
  public:
-  OrNode(std::shared_ptr<Node> left, std::shared_ptr<Node> right)
-      : left(left), right(right) {}
+  OrNode(std::shared_ptr<Node> left, std::shared_ptr<Node> right) {
+    for (const auto& child : {left, right}) {
+      if (auto node = std::dynamic_pointer_cast<OrNode>(child)) {
+        children.insert(children.end(), node->children.begin(),
+                        node->children.end());
+      } else {
+        children.push_back(child);
+      }
+    }
+    for (const auto& child : children) {
+      total_cost += child->cost();
+      heap.emplace_back(child->doc(), child.get());
+    }
+    std::make_heap(heap.begin(), heap.end(), std::greater<>());
+  }
+
+  virtual size_t doc() const override { return heap.front().first; }
+
+  virtual void next() override {
+    size_t current = doc();
+    while (current != end && heap.front().first == current) {
+      std::pop_heap(heap.begin(), heap.end(), std::greater<>());
+      heap.back().second->next();
+      heap.back().first = heap.back().second->doc();
+      std::push_heap(heap.begin(), heap.end(), std::greater<>());
+    }
+  }
 
-  virtual std::set<size_t> calculate() const override {
-    std::set<size_t> s;
-    std::set<size_t> s1 = left->calculate();
-    std::set<size_t> s2 = right->calculate();
-    std::set_union(s1.begin(), s1.end(), s2.begin(), s2.end(),
-                   std::inserter(s, s.begin()));
-    return s;
+  virtual void advance(size_t target) override {
+    while (heap.front().first < target) {
+      std::pop_heap(heap.begin(), heap.end(), std::greater<>());
+      heap.back().second->advance(target);
+      heap.back().first = heap.back().second->doc();
+      std::push_heap(heap.begin(), heap.end(), std::greater<>());
+    }
   }
 
+  virtual size_t cost() const override { return total_cost; }
+
  private:
-  std::shared_ptr<Node> left;
-  std::shared_ptr<Node> right;
+  std::vector<std::shared_ptr<Node>> children;
+  std::vector<std::pair<size_t, Node*>> heap;
+  size_t total_cost = 0;
+};
+
+// Positional nodes only check positions of the documents that match all of
+// their operands, which they find as a conjunction first.
+class PhraseNode : public PositionalNode {
+ public:
+  PhraseNode(const std::vector<std::shared_ptr<PositionalNode>>& terms);
+
+  virtual size_t doc() const override { return conjunction->doc(); }
+
+  virtual void next() override {
+    conjunction->next();
+    verify();
+  }
+
+  virtual void advance(size_t target) override {
+    conjunction->advance(target);
+    verify();
+  }
+
+  virtual size_t cost() const override { return conjunction->cost(); }
+
+  virtual void positions(std::vector<size_t>& out) override { out = starts; }
+
+  virtual size_t length() const override { return terms.size(); }
+
+ private:
+  std::vector<std::shared_ptr<PositionalNode>> terms;
+  std::shared_ptr<Node> conjunction;
+  std::vector<size_t> starts;
+  std::vector<size_t> buffer;
+
+  bool matches();
+
+  void verify() {
+    while (conjunction->doc() != end && !matches()) {
+      conjunction->next();
+    }
+  }
 };
 
-struct PostingIterator {
-  using iterator_type = std::map<size_t, size_t>::iterator;
-  iterator_type it1;
-  iterator_type it2;
-  std::string term;
+// Documents where spans of the operands are at most distance tokens apart,
+// in either order. Adjacent spans are one token apart.
+class NearNode : public Node {
+ public:
+  NearNode(std::shared_ptr<PositionalNode> left,
+           std::shared_ptr<PositionalNode> right, size_t distance)
+      : left(left),
+        right(right),
+        conjunction(std::make_shared<AndNode>(left, right)),
+        distance(distance) {
+    verify();
+  }
+
+  virtual size_t doc() const override { return conjunction->doc(); }
+
+  virtual void next() override {
+    conjunction->next();
+    verify();
+  }
+
+  virtual void advance(size_t target) override {
+    conjunction->advance(target);
+    verify();
+  }
+
+  virtual size_t cost() const override { return conjunction->cost(); }
+
+ private:
+  std::shared_ptr<PositionalNode> left;
+  std::shared_ptr<PositionalNode> right;
+  std::shared_ptr<Node> conjunction;
+  const size_t distance;
+  std::vector<size_t> left_positions;
+  std::vector<size_t> right_positions;
 
-  PostingIterator(iterator_type it1, iterator_type it2, const std::string& term)
-      : it1(it1), it2(it2), term(term) {}
+  bool matches();
+
+  void verify() {
+    while (conjunction->doc() != end && !matches()) {
+      conjunction->next();
+    }
+  }
+};
+
+// Fixed-capacity min-heap of the k best (score, DID) pairs. On ties the
+// lower DID is better, so the kept documents do not depend on the order they
+// are pushed in, and Sorted() lists the best first with tied scores by
+// descending DID.
+class TopK {
+  size_t k_;
+  std::vector<std::pair<double, size_t>> heap_;
+  size_t pushes_ = 0;
+
+  static bool Better(const std::pair<double, size_t>& a,
+                     const std::pair<double, size_t>& b);
+
+ public:
+  TopK(size_t k) : k_(k) { heap_.reserve(std::min<size_t>(k, 1 << 16)); }
+
+  size_t Capacity() const { return k_; }
+
+  bool Full() const { return heap_.size() >= k_; }
+
+  double Threshold() const { return heap_.front().first; }
+
+  void Push(const double rel, const size_t DID);
+
+  // Documents scored so far.
+  size_t Pushes() const { return pushes_; }
+
+  std::vector<std::pair<double, size_t>> Sorted() const;
+};
+
+// Scratch state of one request: the terms found in the index, the lines of
+// the results and the statistics.
+struct QueryContext {
+  std::map<std::string, TermInfo> terms;
+  std::map<size_t, std::vector<size_t>> lines;
+  QueryStats stats;
 };
 
+// Requests may run on several threads at once. After Open() the index is
+// only read, every request keeps its state in a QueryContext of its own,
+// and the caches and session statistics are shared behind locks. A request
+// that finds a new index generation on disk reopens the index once the
+// requests running on the old one are done. Open(), Close() and the setters
+// must not run concurrently with requests.
 class SimpleSearchEngine {
  private:
   double N;
   double dl_all;
 
-  const double k = 2;
-  const double b = 0.75;
+  std::vector<IndexSegment> segments_;
+  ii::Codec codec_ = ii::Codec::Varint;
+  bool impacts_ = false;
+  bool exhaustive_ = false;
+  bool exact_ = false;
+
+  // Rendered results by canonical query and k, valid for one index
+  // generation.
+  LruCache<std::string, std::string> cache_{1024};
+  size_t cache_hits_ = 0;
+  size_t cache_misses_ = 0;
+  mutable std::mutex cache_mutex_;
+  // Helpers of the requests heavy enough to be split into DID ranges.
+  std::unique_ptr<ThreadPool> query_pool_;
+  size_t parallel_cost_ = 1 << 15;
+  PostingCache posting_cache_{64 << 20};
+  std::mutex posting_mutex_;
+  size_t generation_ = 0;
+  // File that holds the generation: shards.bin, or segments.bin for a single
+  // index. Writers rename a new one into place on every change, so its inode
+  // and mtime tell a request whether to reread it.
+  struct Stamp {
+    bool sharded = false;
+    uint64_t inode = 0;
+    int64_t mtime = 0;
 
-  std::map<size_t, DocInfo> documents_;
-  std::map<std::string, TermInfo> terms_;
-  std::vector<std::map<size_t, size_t>> posting_table_;
-  std::map<size_t, std::vector<size_t>> position_table_;
+    bool operator==(const Stamp&) const = default;
+  };
+  // Stamp taken before the open index was read.
+  Stamp stamp_;
+  // Held shared by requests and exclusively to reopen the index.
+  std::shared_mutex open_mutex_;
+  QueryStats last_stats_;
+  SessionStats session_stats_;
+  std::ostream* stats_out_ = nullptr;
+  mutable std::mutex stats_mutex_;
+  ii::MappedFile info_file_;
+  ii::MappedFile tombstone_file_;
+  // Documents marked in the tombstones, whose postings are skipped but still
+  // counted in the df of their terms.
+  size_t deleted_ = 0;
+  ii::DocTable doc_table_;
+  // Engines of the shards of a sharded index, which score with the document
+  // count, lengths and df of the whole index.
+  std::vector<std::unique_ptr<SimpleSearchEngine>> shards_;
+  std::unique_ptr<ThreadPool> shard_pool_;
 
-  const std::string doc_info_path = "info/doc.bin";
-  const std::string term_info_path = "info/term.bin";
-  const std::string posting_table_path = "info/posting_table.bin";
-  const std::string position_table_path = "info/position_table.bin";
-  const std::string info_path = "info/info.bin";
+  const std::string info_directory;
+  const std::string doc_info_path = info_directory + "doc.bin";
+  const std::string doc_path_path = info_directory + "doc_path.bin";
+  const std::string doc_line_path = info_directory + "doc_line.bin";
+  const std::string tombstone_path = info_directory + "tombstone.bin";
+  const std::string segments_path = info_directory + "segments.bin";
+  const std::string info_path = info_directory + "info.bin";
+  const std::string shards_path = info_directory + "shards.bin";
 
-  void GetInfo(const std::set<std::string>& words);
+  bool OpenShards();
 
-  void GetDocs(const std::set<std::size_t>& docs);
+  Stamp StoredStamp() const;
 
-  void GetLines(const std::set<size_t>& DID);
+  // Whether the index on disk is not the one that is open. Only stats the
+  // file that holds the generation.
+  bool Changed() const;
 
-  size_t Read(std::ifstream& file) const;
+  void GetInfo(const std::set<std::string>& words, QueryContext& context);
 
-  double FindRelevance(const std::string& term, const size_t DID);
+  void GetLines(const std::set<size_t>& DID, QueryContext& context) const;
+
+  TermCursor MakeCursor(const TermInfo& info) const;
+
+  // Cursor over the encoded postings, which carry positions.
+  TermCursor PositionCursor(const TermInfo& info) const;
+
+  // Node of a word or a phrase. Positional nodes are built for NEAR
+  // operands.
+  std::shared_ptr<Node> MakeOperand(const std::string& token, bool positional,
+                                    const QueryContext& context) const;
+
+  std::shared_ptr<const DecodedPostings> Decode(const TermInfo& info) const;
+
+  std::string CanonicalQuery(const std::vector<std::string>& expression) const;
+
+  void Search(const std::vector<std::string>& exp,
+              std::set<std::string>& words, const size_t k,
+              QueryContext& context, std::ostream& out);
+
+  // Best k matches of the expression over the found words, best first.
+  std::vector<std::pair<double, size_t>> Evaluate(
+      const std::vector<std::string>& exp, const std::set<std::string>& words,
+      const size_t k, QueryContext& context) const;
+
+  // Looks the words up and evaluates the expression on every shard at once,
+  // then keeps the best k of the shard results. Ties go by path as in a
+  // single index.
+  void SearchShards(const std::vector<std::string>& exp,
+                    const std::set<std::string>& words, const size_t k,
+                    QueryContext& context, std::ostream& out);
+
+  double FindRelevance(const double tf, const double df,
+                       const double dl) const;
+
+  double Score(const TermCursor& it, const size_t df, const size_t DID) const;
+
+  double MaxRelevance(const ii::SkipEntry& block, const size_t df) const;
+
+  // Block-max WAND over a pure disjunction. Documents are only scored when
+  // the block bounds of the terms that may hold them beat the k-th score, so
+  // the result matches the exhaustive ranking. Only documents in
+  // [first, last) are considered, as in Rank().
+  void DisjunctiveTopK(const std::set<std::string>& words,
+                       const QueryContext& context, const size_t first,
+                       const size_t last, TopK& top) const;
+
+  // Scores every match of the expression with a DID in [first, last).
+  void Rank(std::shared_ptr<Node> expression,
+            const std::set<std::string>& words, const QueryContext& context,
+            const size_t first, const size_t last, TopK& top) const;
+
+  // Bounds of parts DID ranges holding about as many postings of the words
+  // each, cut at block ends taken from the skip data. The first bound is 0,
+  // the last Node::end, and empty ranges are dropped.
+  std::vector<size_t> Partition(const std::set<std::string>& words,
+                                const QueryContext& context,
+                                const size_t parts) const;
 
   std::shared_ptr<Node> ParseExpression(
       const std::vector<std::string>& expression, const size_t start,
-      const size_t end);
+      const size_t end, const QueryContext& context) const;
 
  public:
+  SimpleSearchEngine(const std::string& directory = "info/");
+
   bool CheckСorrectness(const std::vector<std::string>& request) const;
 
   std::vector<std::string> SplitRequest(std::string& request) const;
 
-  void Request(std::string& request, const size_t k);
+  bool Open();
+
+  bool IsOpen() const;
+
+  void Close();
+
+  // Scores every match instead of skipping with block-max WAND.
+  void SetExhaustive(bool exhaustive);
+
+  // Scores with float BM25 even when the index carries quantized impacts.
+  void SetExact(bool exact);
+
+  // Threads a heavy request is split over by DID ranges, each with a top-k
+  // of its own that are merged at the end. One turns the splitting off.
+  // Requests are heavy from min_cost estimated postings to walk: all
+  // postings of a disjunction, the matches bound of other expressions.
+  void SetQueryThreads(size_t threads, size_t min_cost = 1 << 15);
+
+  // Number of results kept in the query cache, zero turns it off.
+  void SetCacheSize(size_t size);
+
+  // Memory cap in bytes of the decoded posting lists kept across queries,
+  // zero turns them off.
+  void SetPostingCacheSize(size_t bytes);
+
+  const PostingCache& Postings() const;
+
+  size_t CacheHits() const;
+
+  size_t CacheMisses() const;
+
+  size_t Generation() const;
+
+  // Writes a JSON line of statistics after every request to out, nullptr
+  // turns it off.
+  void SetStatsOutput(std::ostream* out);
+
+  // Statistics of the request that finished last.
+  QueryStats LastStats() const;
+
+  SessionStats Session() const;
+
+  void Request(std::string& request, const size_t k,
+               std::ostream& out = std::cout, std::ostream& err = std::cerr);
+
+  void Serve(std::istream& in, std::ostream& out, std::ostream& err);
+
+  // Runs (k, request) pairs on threads threads and prints the results, and
+  // the errors, in input order as if they had run one after another.
+  void Batch(std::vector<std::pair<size_t, std::string>> requests,
+             const size_t threads, std::ostream& out = std::cout,
+             std::ostream& err = std::cerr);
 };
 
 }  // namespace sse
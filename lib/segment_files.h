@@ -0,0 +1,34 @@
+#pragma once
+
+#include <string>
+
+namespace ii {
+
+// Files of one immutable segment of the index. The base segment lives in
+// info/ itself, every incremental update adds a delta segment next to it.
+struct SegmentFiles {
+  std::string term_info_path;
+  std::string term_index_path;
+  std::string posting_table_path;
+  std::string position_table_path;
+
+  SegmentFiles(const std::string& directory)
+      : term_info_path(directory + "term.bin"),
+        term_index_path(directory + "term_index.bin"),
+        posting_table_path(directory + "posting_table.bin"),
+        position_table_path(directory + "position_table.bin") {}
+};
+
+inline std::string DeltaDirectory(const std::string& info_directory,
+                                  size_t delta) {
+  return info_directory + "delta_" + std::to_string(delta) + "/";
+}
+
+// A sharded index keeps a complete index per shard under info/ and lists
+// them in shards.bin.
+inline std::string ShardDirectory(const std::string& info_directory,
+                                  size_t shard) {
+  return info_directory + "shard_" + std::to_string(shard) + "/";
+}
+
+}  // namespace ii
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace sse {
+
+// Fixed set of threads running submitted tasks in submission order. The
+// destructor waits for the queued tasks and joins the threads.
+class ThreadPool {
+  std::vector<std::thread> workers_;
+  std::deque<std::function<void()>> tasks_;
+  std::mutex mutex_;
+  std::condition_variable ready_;
+  bool stopping_ = false;
+
+  void Work() {
+    while (true) {
+      std::unique_lock lock(mutex_);
+      ready_.wait(lock, [this]() { return stopping_ || !tasks_.empty(); });
+      if (tasks_.empty()) {
+        return;
+      }
+      std::function<void()> task = std::move(tasks_.front());
+      tasks_.pop_front();
+      lock.unlock();
+      task();
+    }
+  }
+
+ public:
+  ThreadPool(size_t threads) {
+    for (size_t i = 0; i < threads; ++i) {
+      workers_.emplace_back([this]() { Work(); });
+    }
+  }
+
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  ~ThreadPool() {
+    {
+      std::lock_guard lock(mutex_);
+      stopping_ = true;
+    }
+    ready_.notify_all();
+    for (auto& worker : workers_) {
+      worker.join();
+    }
+  }
+
+  size_t Size() const { return workers_.size(); }
+
+  void Submit(std::function<void()> task) {
+    {
+      std::lock_guard lock(mutex_);
+      tasks_.push_back(std::move(task));
+    }
+    ready_.notify_one();
+  }
+
+  // Runs task(i) for every i below n on the pool and the calling thread and
+  // returns when all are done. Indices are claimed one by one and the caller
+  // claims too, so this never waits on a task nobody runs, even when the
+  // pool is busy or the caller is one of its tasks.
+  void Run(size_t n, const std::function<void(size_t)>& task) {
+    struct State {
+      std::atomic<size_t> next = 0;
+      size_t done = 0;
+      std::mutex mutex;
+      std::condition_variable finished;
+    };
+    auto state = std::make_shared<State>();
+    // Helpers starting after the return find nothing left to claim and never
+    // touch task.
+    auto work = [state, n, &task]() {
+      size_t count = 0;
+      for (size_t i; (i = state->next++) < n; ++count) {
+        task(i);
+      }
+      if (count != 0) {
+        std::lock_guard lock(state->mutex);
+        state->done += count;
+        state->finished.notify_one();
+      }
+    };
+    for (size_t i = 0; i + 1 < n && i < workers_.size(); ++i) {
+      Submit(work);
+    }
+    work();
+    std::unique_lock lock(state->mutex);
+    state->finished.wait(lock, [&state, n]() { return state->done == n; });
+  }
+};
+
+}  // namespace sse
@@ -0,0 +1,171 @@
+#include "tokenizer.h"
+
+#include <cctype>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define II_X86 1
+#endif
+
+namespace {
+
+enum ByteClass : uint8_t { Word = 0, Space = 1, Punct = 2 };
+
+// Byte classes and lowercase forms in the C locale, which is what the
+// indexer has always used.
+struct ByteTables {
+  uint8_t classes[256];
+  char lower[256];
+
+  ByteTables() {
+    for (int c = 0; c < 256; ++c) {
+      char byte = static_cast<char>(c);
+      classes[c] = std::isspace(c)                                   ? Space
+                   : std::ispunct(c) && byte != '-' && byte != '_' ? Punct
+                                                                   : Word;
+      lower[c] = static_cast<char>(std::tolower(c));
+    }
+  }
+};
+
+const ByteTables tables;
+
+uint8_t Class(char c) { return tables.classes[static_cast<uint8_t>(c)]; }
+
+// Lowercases and compacts the word at ptr, leaving ptr on the byte after it.
+// Returns the end of the term.
+char* ScanWord(char*& ptr, const char* end) {
+  for (; ptr != end && Class(*ptr) == Word; ++ptr) {
+    *ptr = tables.lower[static_cast<uint8_t>(*ptr)];
+  }
+  char* out = ptr;
+  for (; ptr != end && Class(*ptr) != Space; ++ptr) {
+    if (Class(*ptr) == Word) {
+      *out++ = tables.lower[static_cast<uint8_t>(*ptr)];
+    }
+  }
+  return out;
+}
+
+bool IsTerm(const char* begin, size_t size) {
+  return size != 0 && !(size == 1 && (*begin == '-' || *begin == '_'));
+}
+
+#ifdef II_X86
+__attribute__((target("avx2"))) __m256i InRange(__m256i bytes, char low,
+                                                char high) {
+  __m256i offset = _mm256_sub_epi8(bytes, _mm256_set1_epi8(low));
+  __m256i limit = _mm256_set1_epi8(static_cast<char>(high - low));
+  return _mm256_cmpeq_epi8(_mm256_min_epu8(offset, limit), offset);
+}
+
+// Lowercases 32 bytes in place and sets the bits of whitespace, punctuation
+// and newlines among them.
+__attribute__((target("avx2"))) void Classify32(char* ptr, uint32_t& spaces,
+                                                uint32_t& puncts,
+                                                uint32_t& newlines) {
+  __m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(ptr));
+  __m256i upper = InRange(bytes, 'A', 'Z');
+  __m256i kept = _mm256_or_si256(
+      _mm256_or_si256(upper, InRange(bytes, 'a', 'z')),
+      _mm256_or_si256(
+          InRange(bytes, '0', '9'),
+          _mm256_or_si256(_mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('-')),
+                          _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('_')))));
+  spaces = _mm256_movemask_epi8(
+      _mm256_or_si256(_mm256_cmpeq_epi8(bytes, _mm256_set1_epi8(' ')),
+                      InRange(bytes, '\t', '\r')));
+  puncts =
+      _mm256_movemask_epi8(_mm256_andnot_si256(kept, InRange(bytes, '!', '~')));
+  newlines =
+      _mm256_movemask_epi8(_mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('\n')));
+  _mm256_storeu_si256(
+      reinterpret_cast<__m256i*>(ptr),
+      _mm256_or_si256(bytes, _mm256_and_si256(upper, _mm256_set1_epi8(0x20))));
+}
+
+const bool has_avx2 = __builtin_cpu_supports("avx2");
+#endif
+
+}  // namespace
+
+bool ii::Tokenizer::NextScalar(std::string_view& term) {
+  while (true) {
+    for (; ptr_ != end_ && Class(*ptr_) == Space; ++ptr_) {
+      line_ += *ptr_ == '\n';
+    }
+    if (ptr_ == end_) {
+      return false;
+    }
+    char* begin = ptr_;
+    char* out = ScanWord(ptr_, end_);
+    if (IsTerm(begin, out - begin)) {
+      term = std::string_view(begin, out - begin);
+      return true;
+    }
+  }
+}
+
+bool ii::Tokenizer::Next(std::string_view& term) {
+#ifdef II_X86
+  if (has_avx2) {
+    return NextBlock(term);
+  }
+#endif
+  return NextScalar(term);
+}
+
+#ifdef II_X86
+__attribute__((target("avx2,popcnt,bmi"))) bool ii::Tokenizer::NextBlock(
+    std::string_view& term) {
+  while (end_ - ptr_ >= 64) {
+    if (ptr_ < block_ || ptr_ >= block_ + 64) {
+      block_ = ptr_;
+      uint32_t masks[2][3];
+      for (int half = 0; half < 2; ++half) {
+        Classify32(block_ + 32 * half, masks[half][0], masks[half][1],
+                   masks[half][2]);
+      }
+      spaces_ = masks[0][0] | static_cast<uint64_t>(masks[1][0]) << 32;
+      puncts_ = masks[0][1] | static_cast<uint64_t>(masks[1][1]) << 32;
+      newlines_ = masks[0][2] | static_cast<uint64_t>(masks[1][2]) << 32;
+    }
+    uint64_t rest = ~uint64_t{0} << (ptr_ - block_);
+    uint64_t words = ~spaces_ & rest;
+    if (words == 0) {
+      line_ += __builtin_popcountll(newlines_ & rest);
+      ptr_ = block_ + 64;
+      continue;
+    }
+    size_t start = __builtin_ctzll(words);
+    line_ += __builtin_popcountll(newlines_ & rest &
+                                  ((uint64_t{1} << start) - 1));
+    char* begin = block_ + start;
+    uint64_t stops = spaces_ & (~uint64_t{0} << start);
+    char* out;
+    if (stops == 0) {
+      // The word runs past the block.
+      ptr_ = begin;
+      out = ScanWord(ptr_, end_);
+    } else {
+      size_t stop = __builtin_ctzll(stops);
+      ptr_ = block_ + stop;
+      out = ptr_;
+      uint64_t word = ((uint64_t{1} << stop) - 1) & (~uint64_t{0} << start);
+      if (puncts_ & word) {
+        out = begin;
+        for (char* p = begin; p != ptr_; ++p) {
+          if (Class(*p) == Word) {
+            *out++ = *p;
+          }
+        }
+      }
+    }
+    if (IsTerm(begin, out - begin)) {
+      term = std::string_view(begin, out - begin);
+      return true;
+    }
+  }
+  return NextScalar(term);
+}
+#endif
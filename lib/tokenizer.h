@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+namespace ii {
+
+// Splits text into the terms of the index: whitespace-separated words with
+// punctuation other than '-' and '_' dropped and letters lowercased, the way
+// NormalizeTerm treats a single word. Terms are compacted and lowercased in
+// place, so they are views into the buffer and nothing is allocated.
+//
+// Where AVX2 is available the text is classified 64 bytes at a time into
+// bitmasks of whitespace, punctuation and newlines, and terms are cut out of
+// the masks. Words crossing a block and the tail of the text go through a
+// byte table.
+class Tokenizer {
+  char* ptr_;
+  char* end_;
+  size_t line_ = 1;
+
+  char* block_ = nullptr;
+  uint64_t spaces_ = 0;
+  uint64_t puncts_ = 0;
+  uint64_t newlines_ = 0;
+
+  bool NextScalar(std::string_view& term);
+
+  bool NextBlock(std::string_view& term);
+
+ public:
+  Tokenizer(char* begin, char* end) : ptr_(begin), end_(end) {}
+
+  bool Next(std::string_view& term);
+
+  // Line of the last term, counted from 1.
+  size_t Line() const { return line_; }
+};
+
+}  // namespace ii
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cstdint>
+#include <istream>
+#include <ostream>
+
+namespace ii {
+
+inline void WriteVarint(std::ostream& file, size_t n) {
+  while (n >= (1 << 7)) {
+    file.put(static_cast<char>(n % (1 << 7) + (1 << 7)));
+    n >>= 7;
+  }
+  file.put(static_cast<char>(n));
+}
+
+inline size_t ReadVarint(std::istream& file) {
+  size_t ans = 0;
+  size_t shift = 0;
+  uint8_t byte = 0;
+  do {
+    file.read(reinterpret_cast<char*>(&byte), 1);
+    ans |= static_cast<size_t>(byte % (1 << 7)) << shift;
+    shift += 7;
+  } while (byte >= (1 << 7) && file);
+  return ans;
+}
+
+inline void WriteFixed64(std::ostream& file, uint64_t n) {
+  for (size_t i = 0; i < sizeof(uint64_t); ++i) {
+    file.put(static_cast<char>(n >> (8 * i)));
+  }
+}
+
+inline uint64_t LoadFixed64(const uint8_t* data) {
+  uint64_t n = 0;
+  for (size_t i = 0; i < sizeof(uint64_t); ++i) {
+    n |= static_cast<uint64_t>(data[i]) << (8 * i);
+  }
+  return n;
+}
+
+}  // namespace ii
@@ -1,5 +1,9 @@
 #include "lib/search.h"
 
+#include <fcntl.h>
+#include <sys/file.h>
+#include <unistd.h>
+
 #include <gtest/gtest.h>
 
 #include "lib/index.h"
@@ -7,6 +11,35 @@
 using namespace ii;
 using namespace sse;
 
+class FilesEnvironment : public ::testing::Environment {
+ public:
+  void SetUp() override {
+    std::filesystem::create_directories("files/test");
+    std::ofstream("files/test/2.txt") << "apple apple lol\napple\n";
+    std::ofstream("files/test/3.txt") << "apple\n";
+  }
+};
+
+::testing::Environment* const files_env =
+    ::testing::AddGlobalTestEnvironment(new FilesEnvironment);
+
+// Runs the indexer with the flags on an index directory of the calling test.
+// Every call gets a new InvertedIndex, options do not carry over.
+void BuildIndex(const std::string& directory,
+                std::vector<const char*> flags) {
+  InvertedIndex index(directory);
+  flags.insert(flags.begin(), "build/bin/index_launcher");
+  index.Launcher(flags.size(), const_cast<char**>(flags.data()));
+}
+
+std::string Query(const std::string& directory, size_t k,
+                  std::string request) {
+  SimpleSearchEngine search(directory);
+  std::ostringstream out;
+  search.Request(request, k, out);
+  return out.str();
+}
+
 TEST(SearchTestSuit, RequestCorrectnessTest) {
   SimpleSearchEngine search;
   std::vector<std::string> correct_requests{
@@ -26,6 +59,21 @@ TEST(SearchTestSuit, RequestCorrectnessTest) {
   }
 }
 
+TEST(SearchTestSuit, EmptyRequestTest) {
+  SimpleSearchEngine search;
+  std::istringstream input("10\n\n10\n   \n");
+  std::ostringstream out;
+  std::ostringstream err;
+  search.Serve(input, out, err);
+  ASSERT_EQ(out.str(), "\n\n");
+  ASSERT_EQ(err.str(), "Invalid request\nInvalid request\n");
+  out.str("");
+  err.str("");
+  search.Batch({{10, ""}, {5, " "}}, 2, out, err);
+  ASSERT_EQ(out.str(), "");
+  ASSERT_EQ(err.str(), "Invalid request\nInvalid request\n");
+}
+
 TEST(SearchTestSuit, VarintTest) {
   InvertedIndex in;
   std::vector<uint8_t> bytes = in.VarintEncoding(0);
@@ -55,37 +103,24 @@ TEST(SearchTestSuit, VarintTest) {
 }
 
 TEST(SearchTestSuit, FilesCreatureTest) {
-  InvertedIndex(in);
-  int argc = 3;
-  char** argv = new char*[argc];
-  argv[0] = (char*)"build/bin/index_launcher";
-  argv[1] = (char*)"-i";
-  argv[2] = (char*)"files";
-  in.Launcher(argc, argv);
-  std::ifstream info("info/info.bin");
-  std::ifstream doc("info/doc.bin");
-  std::ifstream posi("info/position_table.bin");
-  std::ifstream post("info/posting_table.bin");
-  std::ifstream term("info/term.bin");
+  BuildIndex("creature_info/", {"-i", "files"});
+  std::ifstream info("creature_info/info.bin");
+  std::ifstream doc("creature_info/doc.bin");
+  std::ifstream posi("creature_info/position_table.bin");
+  std::ifstream post("creature_info/posting_table.bin");
+  std::ifstream term("creature_info/term.bin");
   ASSERT_TRUE(info.is_open());
   ASSERT_TRUE(doc.is_open());
   ASSERT_TRUE(posi.is_open());
   ASSERT_TRUE(post.is_open());
   ASSERT_TRUE(term.is_open());
-  delete[] argv;
 }
 
 TEST(SearchTestSuit, InfoCodingTest) {
-  InvertedIndex(in);
-  int argc = 3;
-  char** argv = new char*[argc];
-  argv[0] = (char*)"build/bin/index_launcher";
-  argv[1] = (char*)"-i";
-  argv[2] = (char*)"files";
-  in.Launcher(argc, argv);
-  std::ifstream info("info/info.bin");
+  BuildIndex("info_coding_info/", {"-i", "files"});
+  std::ifstream info("info_coding_info/info.bin");
   std::vector<uint8_t> bytes;
-  std::vector<uint8_t> ans{5, 139, 9};
+  std::vector<uint8_t> ans{2, 5};
   while (!info.eof()) {
     uint8_t byte;
     info.read(reinterpret_cast<char*>(&byte), 1);
@@ -98,21 +133,14 @@ TEST(SearchTestSuit, InfoCodingTest) {
   for (int i = 0; i < ans.size(); ++i) {
     ASSERT_EQ(ans[i], bytes[i]);
   }
-  delete[] argv;
 }
 
 TEST(SearchTestSuit, TermCodingTest) {
-  InvertedIndex(in);
-  int argc = 3;
-  char** argv = new char*[argc];
-  argv[0] = (char*)"build/bin/index_launcher";
-  argv[1] = (char*)"-i";
-  argv[2] = (char*)"files/test";
-  in.Launcher(argc, argv);
-  std::ifstream term("info/term.bin");
+  BuildIndex("term_coding_info/", {"-i", "files/test"});
+  std::ifstream term("term_coding_info/term.bin");
   std::vector<uint8_t> bytes;
-  std::vector<uint8_t> ans{5, 97, 112, 112, 108, 101, 2, 0,
-                           0, 3,  108, 111, 108, 1,   4, 4};
+  std::vector<uint8_t> ans{0, 5, 97,  112, 112, 108, 101, 2, 0,
+                           0, 0, 3,   108, 111, 108, 1,   4, 4};
   while (!term.eof()) {
     uint8_t byte;
     term.read(reinterpret_cast<char*>(&byte), 1);
@@ -125,23 +153,15 @@ TEST(SearchTestSuit, TermCodingTest) {
   for (int i = 0; i < ans.size(); ++i) {
     ASSERT_EQ(ans[i], bytes[i]);
   }
-  delete[] argv;
 }
 
 TEST(SearchTestSuit, DocCodingTest) {
-  InvertedIndex(in);
-  int argc = 3;
-  char** argv = new char*[argc];
-  argv[0] = (char*)"build/bin/index_launcher";
-  argv[1] = (char*)"-i";
-  argv[2] = (char*)"files/test";
-  in.Launcher(argc, argv);
-  std::ifstream doc("info/doc.bin");
+  BuildIndex("doc_coding_info/", {"-i", "files/test"});
+  std::ifstream doc("doc_coding_info/doc.bin");
   std::vector<uint8_t> bytes;
-  std::vector<uint8_t> ans{0,   4,   16,  102, 105, 108, 101, 115, 47,  116,
-                           101, 115, 116, 47,  51,  46,  116, 120, 116, 1,
-                           1,   16,  102, 105, 108, 101, 115, 47,  116, 101,
-                           115, 116, 47,  50,  46,  116, 120, 116};
+  std::vector<uint8_t> ans{4, 0, 0, 0, 0, 0, 0, 0, 0,  0, 0, 0, 0, 0, 0, 0,
+                           0, 0, 0, 0, 0, 0, 0, 0, 1,  0, 0, 0, 0, 0, 0, 0,
+                           16, 0, 0, 0, 0, 0, 0, 0, 4, 0, 0, 0, 0, 0, 0, 0};
   while (!doc.eof()) {
     uint8_t byte;
     doc.read(reinterpret_cast<char*>(&byte), 1);
@@ -154,20 +174,31 @@ TEST(SearchTestSuit, DocCodingTest) {
   for (int i = 0; i < ans.size(); ++i) {
     ASSERT_EQ(ans[i], bytes[i]);
   }
-  delete[] argv;
+  std::ifstream doc_path("doc_coding_info/doc_path.bin");
+  std::string paths;
+  std::getline(doc_path, paths);
+  ASSERT_EQ(paths, "files/test/2.txtfiles/test/3.txt");
+  std::ifstream doc_line("doc_coding_info/doc_line.bin");
+  std::string line_tables;
+  std::getline(doc_line, line_tables);
+  ASSERT_EQ(line_tables, std::string({1, 3, 1, 1, 1, 1}));
+  DocTable table;
+  ASSERT_TRUE(table.Open("doc_coding_info/doc.bin",
+                         "doc_coding_info/doc_path.bin",
+                         "doc_coding_info/doc_line.bin"));
+  ASSERT_EQ(table.Size(), 2);
+  ASSERT_EQ(table.Length(0), 4);
+  ASSERT_EQ(table.Path(0), "files/test/2.txt");
+  ASSERT_EQ(table.Length(1), 1);
+  ASSERT_EQ(table.Path(1), "files/test/3.txt");
+  ASSERT_EQ(table.Lines(0, {0, 1, 2, 3}), std::vector<size_t>({1, 1, 1, 2}));
 }
 
 TEST(SearchTestSuit, PositionCodingTest) {
-  InvertedIndex(in);
-  int argc = 3;
-  char** argv = new char*[argc];
-  argv[0] = (char*)"build/bin/index_launcher";
-  argv[1] = (char*)"-i";
-  argv[2] = (char*)"files/test";
-  in.Launcher(argc, argv);
-  std::ifstream posi("info/position_table.bin");
+  BuildIndex("position_coding_info/", {"-i", "files/test"});
+  std::ifstream posi("position_coding_info/position_table.bin");
   std::vector<uint8_t> bytes;
-  std::vector<uint8_t> ans{1, 0, 1, 1, 1};
+  std::vector<uint8_t> ans{0, 1, 2, 0, 2};
   while (!posi.eof()) {
     uint8_t byte;
     posi.read(reinterpret_cast<char*>(&byte), 1);
@@ -180,18 +211,11 @@ TEST(SearchTestSuit, PositionCodingTest) {
   for (int i = 0; i < ans.size(); ++i) {
     ASSERT_EQ(ans[i], bytes[i]);
   }
-  delete[] argv;
 }
 
 TEST(SearchTestSuit, PostingCodingTest) {
-  InvertedIndex(in);
-  int argc = 3;
-  char** argv = new char*[argc];
-  argv[0] = (char*)"build/bin/index_launcher";
-  argv[1] = (char*)"-i";
-  argv[2] = (char*)"files/test";
-  in.Launcher(argc, argv);
-  std::ifstream post("info/posting_table.bin");
+  BuildIndex("posting_coding_info/", {"-i", "files/test"});
+  std::ifstream post("posting_coding_info/posting_table.bin");
   std::vector<uint8_t> bytes;
   std::vector<uint8_t> ans{0, 3, 1, 1, 0, 1};
   while (!post.eof()) {
@@ -206,5 +230,895 @@ TEST(SearchTestSuit, PostingCodingTest) {
   for (int i = 0; i < ans.size(); ++i) {
     ASSERT_EQ(ans[i], bytes[i]);
   }
-  delete[] argv;
-}
\ No newline at end of file
+}
+
+TEST(SearchTestSuit, MergeTest) {
+  std::filesystem::create_directories("merge_files");
+  for (int i = 0; i < 20; ++i) {
+    std::ofstream file("merge_files/" + std::to_string(100 + i) + ".txt");
+    file << "common\n";
+    for (int j = 0; j < 300; ++j) {
+      file << "word" << (i * 37 + j) % 1000 << ' ';
+    }
+    file << "\ncommon\n";
+  }
+  BuildIndex("merge_info/", {"-i", "merge_files", "--mem-budget", "32K"});
+  Dictionary dictionary;
+  ASSERT_TRUE(
+      dictionary.Open("merge_info/term.bin", "merge_info/term_index.bin"));
+  ASSERT_EQ(dictionary.Size(), 1001);
+  TermEntry entry;
+  ASSERT_TRUE(dictionary.Find("common", entry));
+  ASSERT_EQ(entry.df, 20);
+  for (int i = 0; i < 1000; ++i) {
+    ASSERT_TRUE(dictionary.Find("word" + std::to_string(i), entry));
+    ASSERT_EQ(entry.term, "word" + std::to_string(i));
+  }
+  ASSERT_FALSE(dictionary.Find("a", entry));
+  ASSERT_FALSE(dictionary.Find("word1000", entry));
+  ASSERT_FALSE(dictionary.Find("zzz", entry));
+}
+
+TEST(SearchTestSuit, CursorTest) {
+  InvertedIndex in;
+  std::vector<size_t> numbers{0, 7, 127, 128, 19876, 117891023, SIZE_MAX};
+  std::vector<uint8_t> bytes;
+  for (size_t n : numbers) {
+    std::vector<uint8_t> encoded = in.VarintEncoding(n);
+    bytes.insert(bytes.end(), encoded.begin(), encoded.end());
+  }
+  Cursor cursor(bytes.data(), bytes.data() + bytes.size());
+  for (size_t n : numbers) {
+    ASSERT_EQ(cursor.ReadVarint(), n);
+  }
+  ASSERT_TRUE(cursor.AtEnd());
+}
+
+TEST(SearchTestSuit, ServeTest) {
+  BuildIndex("serve_info/", {"-i", "files/test"});
+  SimpleSearchEngine search("serve_info/");
+  ASSERT_TRUE(search.Open());
+  std::istringstream input("1\nlol\n2\nmissing\nx\nlol\n1\nlol AND (apple)\n");
+  std::ostringstream out;
+  std::ostringstream err;
+  search.Serve(input, out, err);
+  ASSERT_TRUE(search.IsOpen());
+  ASSERT_EQ(out.str(),
+            "files/test/2.txt 1 \n\nNo matching files\n\nfiles/test/2.txt 1 1 "
+            "1 2 \n\n");
+  ASSERT_EQ(err.str(), "Invalid argument\n");
+}
+
+TEST(SearchTestSuit, ParallelIndexTest) {
+  std::filesystem::create_directories("parallel_files/a");
+  std::filesystem::create_directories("parallel_files/b");
+  for (int i = 0; i < 30; ++i) {
+    std::ofstream file("parallel_files/" + std::string(i % 2 ? "a/" : "b/") +
+                       std::to_string(i) + ".txt");
+    for (int j = 0; j < 200; ++j) {
+      file << "term" << (i * 13 + j * 7) % 500 << (j % 10 ? ' ' : '\n');
+    }
+  }
+  std::vector<std::string> files{
+      "info.bin",       "doc.bin",           "doc_path.bin",
+      "term.bin",       "term_index.bin",    "posting_table.bin",
+      "position_table.bin"};
+  auto build = [&files](const char* threads) {
+    BuildIndex("parallel_info/", {"-i", "parallel_files", "-j", threads});
+    std::vector<std::string> contents;
+    for (const auto& path : files) {
+      std::ifstream file("parallel_info/" + path, std::ios::binary);
+      contents.emplace_back(std::istreambuf_iterator<char>(file),
+                            std::istreambuf_iterator<char>());
+    }
+    return contents;
+  };
+  std::vector<std::string> single = build("1");
+  std::vector<std::string> parallel = build("4");
+  for (int i = 0; i < files.size(); ++i) {
+    ASSERT_FALSE(single[i].empty());
+    ASSERT_EQ(single[i], parallel[i]) << files[i];
+  }
+  ASSERT_FALSE(std::filesystem::exists("parallel_info/segment_0_term.run"));
+}
+
+TEST(SearchTestSuit, CrawlerTest) {
+  std::filesystem::remove_all("crawl_files");
+  for (const char* path : {"crawl_files/a/b.txt", "crawl_files/a.txt",
+                           "crawl_files/a-b/c.txt", "crawl_files/ab",
+                           "crawl_files/a/a/z.txt", "crawl_files/b"}) {
+    std::filesystem::create_directories(
+        std::filesystem::path(path).parent_path());
+    std::ofstream(path) << "text\n";
+  }
+  std::vector<std::string> paths;
+  Crawler crawler("crawl_files");
+  for (DocFile file; crawler.Next(file);) {
+    paths.push_back(file.path);
+  }
+  std::vector<std::string> sorted = paths;
+  std::sort(sorted.begin(), sorted.end());
+  ASSERT_EQ(paths.size(), 6);
+  ASSERT_EQ(paths, sorted);
+}
+
+TEST(SearchTestSuit, IncrementalIndexTest) {
+  std::filesystem::remove_all("incremental_files");
+  std::filesystem::create_directories("incremental_files");
+  std::ofstream("incremental_files/a.txt") << "alpha beta\nbeta\n";
+  std::ofstream("incremental_files/b.txt") << "beta gamma\n";
+  std::ofstream("incremental_files/c.txt") << "gamma delta\n";
+  auto search = []() {
+    SimpleSearchEngine search("incremental_info/");
+    std::istringstream input(
+        "10\nbeta\n10\ngamma OR delta\n10\nalpha AND epsilon\n10\nepsilon\n");
+    std::ostringstream out;
+    std::ostringstream err;
+    search.Serve(input, out, err);
+    std::vector<std::string> lines;
+    std::istringstream output(out.str());
+    for (std::string line; std::getline(output, line);) {
+      lines.push_back(line);
+    }
+    std::sort(lines.begin(), lines.end());
+    return lines;
+  };
+  BuildIndex("incremental_info/", {"-i", "incremental_files"});
+  std::ofstream("incremental_files/a.txt") << "alpha alpha\nepsilon\n";
+  std::filesystem::remove("incremental_files/c.txt");
+  std::ofstream("incremental_files/d.txt") << "delta beta epsilon\n";
+  BuildIndex("incremental_info/", {"-i", "incremental_files", "-u"});
+  ASSERT_TRUE(std::filesystem::exists("incremental_info/delta_1/term.bin"));
+  std::vector<std::string> updated = search();
+  BuildIndex("incremental_info/", {"-c"});
+  ASSERT_FALSE(std::filesystem::exists("incremental_info/delta_1"));
+  std::vector<std::string> compacted = search();
+  BuildIndex("incremental_info/", {"-i", "incremental_files"});
+  std::vector<std::string> rebuilt = search();
+  ASSERT_EQ(updated, rebuilt);
+  ASSERT_EQ(compacted, rebuilt);
+  for (const auto& line : rebuilt) {
+    ASSERT_EQ(line.find("c.txt"), std::string::npos);
+  }
+  ASSERT_NE(std::find(rebuilt.begin(), rebuilt.end(),
+                      "incremental_files/a.txt 1 1 2 "),
+            rebuilt.end());
+  // With most documents deleted the update leaves compaction to a
+  // background process, which is done once its lock is free and the delta
+  // segment is gone.
+  std::filesystem::remove("incremental_files/a.txt");
+  std::filesystem::remove("incremental_files/b.txt");
+  std::filesystem::remove("incremental_files/d.txt");
+  std::ofstream("incremental_files/e.txt") << "beta epsilon\n";
+  BuildIndex("incremental_info/", {"-i", "incremental_files", "-u"});
+  for (bool compacting = true; compacting;) {
+    int lock = open("incremental_info/lock", O_RDWR);
+    ASSERT_NE(lock, -1);
+    flock(lock, LOCK_EX);
+    compacting = std::filesystem::exists("incremental_info/delta_1");
+    close(lock);
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  compacted = search();
+  BuildIndex("incremental_info/", {"-i", "incremental_files"});
+  ASSERT_EQ(compacted, search());
+}
+
+TEST(SearchTestSuit, DocExtentTest) {
+  std::filesystem::remove_all("extent_files");
+  std::filesystem::create_directories("extent_files");
+  std::ofstream("extent_files/a.txt") << "alpha\n";
+  std::ofstream("extent_files/b.txt") << "alpha beta\n";
+  BuildIndex("extent_info/", {"-i", "extent_files"});
+  // An update that stopped after appending to the document tables, before
+  // publishing segments.bin.
+  std::ofstream("extent_info/doc_path.bin", std::ios::app)
+      << "extent_files/c.txt";
+  std::ofstream("extent_info/doc.bin", std::ios::app) << std::string(48, '\0');
+  ASSERT_EQ(Query("extent_info/", 10, "alpha"),
+            "extent_files/b.txt 1 \nextent_files/a.txt 1 \n");
+  std::ofstream("extent_files/c.txt") << "gamma\n";
+  BuildIndex("extent_info/", {"-i", "extent_files", "-u"});
+  ASSERT_EQ(Query("extent_info/", 10, "gamma OR beta"),
+            "extent_files/c.txt 1 \nextent_files/b.txt 1 \n");
+}
+
+TEST(SearchTestSuit, MemoryBudgetTest) {
+  std::filesystem::create_directories("budget_info");
+  Segment segment("budget_info/segment_", 1 << 20);
+  ASSERT_EQ(segment.Size(), 0);
+  segment.Add("word", 0, 1);
+  size_t size = segment.Size();
+  ASSERT_GT(size, 0);
+  // Terms and postings are carved out of arena blocks.
+  for (size_t DID = 1; segment.Size() == size; ++DID) {
+    segment.Add("word", DID, DID % 3);
+    ASSERT_LT(DID, Arena::block_size);
+  }
+  ASSERT_GE(segment.Size(), size + Arena::block_size);
+  size = segment.Size();
+  segment.Add(std::string(Arena::block_size, 'x'), 1, 2);
+  ASSERT_GE(segment.Size(), size + Arena::block_size);
+  ASSERT_FALSE(segment.Full());
+  for (int i = 0; !segment.Full(); ++i) {
+    segment.Add("term" + std::to_string(i), i, 1);
+    ASSERT_LT(i, 1 << 20);
+  }
+  segment.Update();
+  ASSERT_EQ(segment.Size(), 0);
+  ASSERT_EQ(segment.Runs().size(), 1);
+  segment.RemoveRuns();
+}
+
+TEST(SearchTestSuit, CodecTest) {
+  std::vector<uint32_t> values;
+  for (uint32_t i = 0; i < 1000; ++i) {
+    values.push_back(i % 7 == 0 ? i * 2654435761u : i % 300);
+  }
+  std::vector<uint8_t> bytes;
+  EncodeStreamVByte(values.data(), values.size(), bytes);
+  std::vector<uint32_t> decoded(values.size());
+  const uint8_t* end = DecodeStreamVByte(
+      bytes.data(), bytes.data() + bytes.size(), values.size(), decoded.data());
+  ASSERT_EQ(end, bytes.data() + bytes.size());
+  ASSERT_EQ(decoded, values);
+
+  std::filesystem::create_directories("codec_files");
+  for (int i = 0; i < 300; ++i) {
+    std::ofstream file("codec_files/" + std::to_string(i) + ".txt");
+    for (int j = 0; j < 40; ++j) {
+      file << "term" << (i * 11 + j * 3) % 60 << (j % 8 ? ' ' : '\n');
+    }
+  }
+  std::string queries =
+      "5\nterm1\n3\nterm2 AND term7\n10\nterm3 OR (term4 AND term5)\n";
+  auto serve = [&queries](const char* codec) {
+    BuildIndex("codec_info/", {"-i", "codec_files", "--codec", codec});
+    SimpleSearchEngine search("codec_info/");
+    std::istringstream input(queries);
+    std::ostringstream out;
+    std::ostringstream err;
+    search.Serve(input, out, err);
+    return out.str();
+  };
+  std::string varint = serve("varint");
+  std::string streamvbyte = serve("streamvbyte");
+  ASSERT_NE(varint.find("codec_files/"), std::string::npos);
+  ASSERT_EQ(varint, streamvbyte);
+}
+
+TEST(SearchTestSuit, SkipTest) {
+  for (Codec codec : {Codec::Varint, Codec::StreamVByte}) {
+    std::ostringstream posting_table;
+    std::ostringstream position_table;
+    PostingWriter writer(codec, posting_table, position_table);
+    std::vector<size_t> DIDs;
+    for (size_t i = 0; i < 1000; ++i) {
+      DIDs.push_back(3 * i + i % 2);
+      writer.Add(DIDs.back(), 10, {i % 4, i % 4 + 1 + i});
+    }
+    writer.Finish();
+    std::string postings = posting_table.str();
+    std::string positions = position_table.str();
+    auto data = [](const std::string& s) {
+      const uint8_t* begin = reinterpret_cast<const uint8_t*>(s.data());
+      return Cursor(begin, begin + s.size());
+    };
+    PostingCursor cursor(codec, data(postings), DIDs.size());
+    for (size_t target : {0, 5, 6, 400, 401, 1500, 2990, 2998}) {
+      auto it = std::lower_bound(DIDs.begin(), DIDs.end(), target);
+      ASSERT_TRUE(cursor.Advance(target));
+      ASSERT_EQ(cursor.DID(), *it);
+      size_t i = it - DIDs.begin();
+      std::vector<size_t> values;
+      cursor.Positions(data(positions), values);
+      ASSERT_EQ(values, std::vector<size_t>({i % 4, i % 4 + 1 + i}));
+    }
+    ASSERT_FALSE(cursor.Advance(3000));
+    ASSERT_TRUE(cursor.AtEnd());
+  }
+
+  std::filesystem::create_directories("skip_files");
+  for (int i = 0; i < 600; ++i) {
+    std::ofstream file("skip_files/" + std::to_string(1000 + i) + ".txt");
+    file << "common filler\n" << (i % 97 == 0 ? "rare\n" : "\n");
+  }
+  BuildIndex("skip_info/", {"-i", "skip_files"});
+  SimpleSearchEngine search("skip_info/");
+  std::istringstream input("10\ncommon AND rare\n10\nrare AND common\n");
+  std::ostringstream out;
+  std::ostringstream err;
+  search.Serve(input, out, err);
+  std::string expected;
+  for (int i = 0; i < 600; i += 97) {
+    expected = "skip_files/" + std::to_string(1000 + i) + ".txt 1 2 \n" +
+               expected;
+  }
+  ASSERT_EQ(out.str(), expected + "\n" + expected + "\n");
+}
+
+TEST(SearchTestSuit, StreamingEvaluationTest) {
+  std::filesystem::create_directories("stream_files");
+  std::set<std::string> expected;
+  for (int i = 0; i < 400; ++i) {
+    std::string path = "stream_files/" + std::to_string(1000 + i) + ".txt";
+    std::ofstream file(path);
+    file << (i % 2 ? "a " : "x ") << (i % 3 ? "y " : "b ")
+         << (i % 5 ? "z\n" : "c\n");
+    if ((i % 2 || i % 3 == 0) && i % 5 == 0) {
+      expected.insert(path);
+    }
+  }
+  BuildIndex("stream_info/", {"-i", "stream_files"});
+  SimpleSearchEngine search("stream_info/");
+  std::string request = "((a OR b) AND c) AND (x OR y OR z OR a OR b)";
+  std::ostringstream out;
+  search.Request(request, 1000, out);
+  std::set<std::string> found;
+  std::istringstream lines(out.str());
+  std::string line;
+  while (std::getline(lines, line)) {
+    found.insert(line.substr(0, line.find(' ')));
+  }
+  ASSERT_EQ(found, expected);
+  request = "c AND missing";
+  out.str("");
+  search.Request(request, 10, out);
+  ASSERT_EQ(out.str(), "");
+}
+
+TEST(SearchTestSuit, WandTest) {
+  std::filesystem::remove_all("wand_files");
+  std::filesystem::create_directories("wand_files");
+  uint64_t seed = 42;
+  auto random = [&seed]() {
+    seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+    return seed >> 33;
+  };
+  auto write = [&random](int i) {
+    std::ofstream file("wand_files/" + std::to_string(i) + ".txt");
+    size_t words = 5 + random() % 60;
+    for (size_t j = 0; j < words; ++j) {
+      file << "w" << 40 / (1 + random() % 40) << (j % 7 ? ' ' : '\n');
+    }
+  };
+  for (int i = 0; i < 1500; ++i) {
+    write(i);
+  }
+  std::string queries =
+      "10\nw1 OR w2\n1\nw40\n5\nw1 OR w3 OR w13 OR w40\n20\nw2 OR (w5 OR w8)\n"
+      "3\nw1 OR missing OR w20\n0\nw1 OR w2\n";
+  auto compare = [&queries]() {
+    std::string results[2];
+    for (bool exhaustive : {false, true}) {
+      SimpleSearchEngine search("wand_info/");
+      search.SetExhaustive(exhaustive);
+      std::istringstream input(queries);
+      std::ostringstream out;
+      std::ostringstream err;
+      search.Serve(input, out, err);
+      results[exhaustive] = out.str();
+    }
+    ASSERT_NE(results[0].find("wand_files/"), std::string::npos);
+    ASSERT_EQ(results[0], results[1]);
+  };
+  BuildIndex("wand_info/", {"-i", "wand_files"});
+  compare();
+  for (int i = 0; i < 1500; i += 7) {
+    write(i);
+  }
+  std::filesystem::remove("wand_files/3.txt");
+  BuildIndex("wand_info/", {"-i", "wand_files", "-u"});
+  compare();
+}
+
+TEST(SearchTestSuit, ImpactTest) {
+  std::filesystem::remove_all("impact_files");
+  std::filesystem::create_directories("impact_files");
+  uint64_t seed = 7;
+  for (int i = 0; i < 800; ++i) {
+    std::ofstream file("impact_files/" + std::to_string(i) + ".txt");
+    for (int j = 0; j < 10 + i % 50; ++j) {
+      seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+      file << "w" << 30 / (1 + (seed >> 33) % 30) << (j % 9 ? ' ' : '\n');
+    }
+  }
+  std::string queries =
+      "10\nw1 OR w2\n5\nw30\n5\nw3 OR w10 OR w30\n10\nw2 AND w5\n";
+  auto serve = [&queries](std::vector<const char*> args, bool exact,
+                          bool exhaustive) {
+    if (!args.empty()) {
+      BuildIndex("impact_info/", args);
+    }
+    SimpleSearchEngine search("impact_info/");
+    search.SetExact(exact);
+    search.SetExhaustive(exhaustive);
+    std::istringstream input(queries);
+    std::ostringstream out;
+    std::ostringstream err;
+    search.Serve(input, out, err);
+    return out.str();
+  };
+  std::string plain = serve({"-i", "impact_files"}, false, false);
+  std::string exact = serve({"-i", "impact_files", "--impacts"}, true, false);
+  ASSERT_EQ(plain, exact);
+  std::string impact = serve({}, false, false);
+  ASSERT_EQ(impact, serve({}, false, true));
+  ASSERT_NE(impact.find("impact_files/"), std::string::npos);
+  std::ifstream segments("impact_info/segments.bin", std::ios::binary);
+  std::vector<uint8_t> bytes{std::istreambuf_iterator<char>(segments),
+                             std::istreambuf_iterator<char>()};
+  ASSERT_GE(bytes.size(), 5);
+  ASSERT_EQ(std::vector<uint8_t>(bytes.begin(), bytes.begin() + 4),
+            std::vector<uint8_t>({0, 0, 160, 6}));
+}
+
+TEST(SearchTestSuit, TopKTest) {
+  TopK top(3);
+  std::vector<double> scores{1, 5, 3, 5, 2, 3, 7, 3};
+  for (size_t DID = 0; DID < scores.size(); ++DID) {
+    top.Push(scores[DID], DID);
+  }
+  std::vector<std::pair<double, size_t>> expected{{7, 6}, {5, 3}, {5, 1}};
+  ASSERT_EQ(top.Sorted(), expected);
+  ASSERT_EQ(top.Threshold(), 5);
+  TopK empty(0);
+  empty.Push(1, 0);
+  ASSERT_TRUE(empty.Sorted().empty());
+}
+
+TEST(SearchTestSuit, QueryCacheTest) {
+  std::filesystem::remove_all("cache_files");
+  std::filesystem::create_directories("cache_files");
+  std::ofstream("cache_files/a.txt") << "vector list\nfor\n";
+  std::ofstream("cache_files/b.txt") << "list for while\n";
+  BuildIndex("cache_info/", {"-i", "cache_files"});
+  SimpleSearchEngine search("cache_info/");
+  auto request = [&search](std::string query, size_t k) {
+    std::ostringstream out;
+    search.Request(query, k, out);
+    return out.str();
+  };
+  std::string first = request("(for OR vector) AND list", 10);
+  ASSERT_EQ(search.CacheMisses(), 1);
+  ASSERT_EQ(request("List AND ((Vector OR for OR vector))", 10), first);
+  ASSERT_EQ(request("((list)) AND (vector OR (for))", 10), first);
+  ASSERT_EQ(search.CacheHits(), 2);
+  request("list AND (for OR vector)", 1);
+  request("list OR (for OR vector)", 10);
+  ASSERT_EQ(search.CacheMisses(), 3);
+  ASSERT_EQ(request("for", 10), "cache_files/b.txt 1 \ncache_files/a.txt 2 \n");
+  size_t generation = search.Generation();
+  search.Close();
+  std::ofstream("cache_files/a.txt") << "while\n";
+  BuildIndex("cache_info/", {"-i", "cache_files"});
+  ASSERT_TRUE(search.Open());
+  ASSERT_EQ(search.Generation(), generation + 1);
+  ASSERT_EQ(request("for", 10), "cache_files/b.txt 1 \n");
+  ASSERT_EQ(search.CacheMisses(), 5);
+  // An open engine notices the new generation of an update on its own.
+  std::ofstream("cache_files/b.txt") << "while\n";
+  BuildIndex("cache_info/", {"-i", "cache_files"});
+  ASSERT_EQ(request("for", 10), "No matching files\n");
+  ASSERT_EQ(search.Generation(), generation + 2);
+  ASSERT_EQ(search.CacheMisses(), 6);
+}
+
+TEST(SearchTestSuit, PostingCacheTest) {
+  auto postings = [](size_t n) {
+    auto decoded = std::make_shared<DecodedPostings>();
+    decoded->DIDs.resize(n);
+    decoded->tfs.resize(n);
+    return decoded;
+  };
+  size_t unit = postings(1)->Bytes();
+  PostingCache cache(10 * unit);
+  for (const char* term : {"small", "small", "small", "large", "large"}) {
+    cache.Find(term);
+  }
+  ASSERT_TRUE(cache.Admits("small"));
+  ASSERT_FALSE(cache.Admits("other"));
+  cache.Insert("small", postings(2));
+  cache.Insert("large", postings(6));
+  ASSERT_EQ(cache.Bytes(), 8 * unit);
+  // 3 requests of 2 postings are worth less than 2 requests of 6.
+  cache.Insert("other", postings(3));
+  ASSERT_EQ(cache.Find("small"), nullptr);
+  ASSERT_NE(cache.Find("large"), nullptr);
+  ASSERT_NE(cache.Find("other"), nullptr);
+  cache.Insert("huge", postings(11));
+  ASSERT_EQ(cache.Find("huge"), nullptr);
+
+  std::filesystem::remove_all("posting_files");
+  std::filesystem::create_directories("posting_files");
+  for (int i = 0; i < 300; ++i) {
+    std::ofstream("posting_files/" + std::to_string(i) + ".txt")
+        << "common" << (i % 2 ? " odd\n" : "\n") << (i % 7 ? "" : "seven\n");
+  }
+  BuildIndex("posting_info/", {"-i", "posting_files"});
+  for (int i = 0; i < 300; i += 3) {
+    std::filesystem::remove("posting_files/" + std::to_string(i) + ".txt");
+  }
+  BuildIndex("posting_info/", {"-i", "posting_files", "-u"});
+  std::string queries =
+      "20\ncommon OR seven\n20\nodd AND seven\n5\nseven\n20\nodd OR seven\n";
+  auto serve = [&queries](SimpleSearchEngine& search) {
+    std::istringstream input(queries);
+    std::ostringstream out;
+    std::ostringstream err;
+    search.SetCacheSize(0);
+    search.Serve(input, out, err);
+    return out.str();
+  };
+  SimpleSearchEngine plain("posting_info/");
+  plain.SetPostingCacheSize(0);
+  SimpleSearchEngine decoded("posting_info/");
+  std::string expected = serve(plain);
+  ASSERT_EQ(serve(decoded), expected);
+  ASSERT_EQ(decoded.Postings().Size(), 2);
+  ASSERT_EQ(serve(decoded), expected);
+  ASSERT_EQ(decoded.Postings().Size(), 3);
+  ASSERT_EQ(plain.Postings().Size(), 0);
+}
+
+TEST(SearchTestSuit, PhraseTest) {
+  std::filesystem::remove_all("phrase_files");
+  std::filesystem::create_directories("phrase_files");
+  std::ofstream("phrase_files/a.txt") << "v.push back (x);\n";
+  std::ofstream("phrase_files/b.txt") << "back push\n";
+  std::ofstream("phrase_files/c.txt") << "push it back\nstd::vector<int> v;\n";
+  std::ofstream("phrase_files/d.txt") << "x push\n\nback\n";
+  BuildIndex("phrase_info/", {"-i", "phrase_files"});
+  SimpleSearchEngine search("phrase_info/");
+  search.SetCacheSize(0);
+  auto paths = [&search](std::string query) {
+    std::ostringstream out;
+    search.Request(query, 10, out);
+    std::set<std::string> found;
+    std::istringstream lines(out.str());
+    for (std::string line; std::getline(lines, line);) {
+      found.insert(line.substr(13, 1));
+    }
+    return found;
+  };
+  using Found = std::set<std::string>;
+  ASSERT_EQ(paths("\"push back\""), Found({"d"}));
+  ASSERT_EQ(paths("\"v.push back\""), Found({"a"}));
+  ASSERT_EQ(paths("push NEAR/1 back"), Found({"b", "d"}));
+  ASSERT_EQ(paths("back NEAR/2 push"), Found({"b", "c", "d"}));
+  ASSERT_EQ(paths("\"Std::Vector<int> V\" AND push"), Found({"c"}));
+  ASSERT_EQ(paths("\"vector v\" OR \"x push\""), Found({"d"}));
+  ASSERT_EQ(paths("\"push it\" NEAR/3 \"int v\""), Found({}));
+  ASSERT_EQ(paths("\"push it\" NEAR/3 \"stdvectorint v\""), Found({"c"}));
+  ASSERT_EQ(paths("(push NEAR/1 back) AND x"), Found({"d"}));
+  std::ostringstream out;
+  std::string query = "\"x push back\"";
+  search.Request(query, 10, out);
+  ASSERT_EQ(out.str(), "phrase_files/d.txt 1 1 3 \n");
+  for (std::string invalid :
+       {"\"push back", "push NEAR/1 (back)", "a NEAR/1 b NEAR/1 c",
+        "\"\" OR push", "NEAR/2 push",
+        "push NEAR/99999999999999999999 back"}) {
+    ASSERT_FALSE(search.CheckСorrectness(search.SplitRequest(invalid)));
+  }
+  std::ostringstream err;
+  query = "push NEAR/99999999999999999999 back";
+  search.Request(query, 10, out, err);
+  ASSERT_EQ(err.str(), "Invalid request\n");
+  ASSERT_EQ(search.SplitRequest(query = "a NEAR/10 \"b c\""),
+            std::vector<std::string>({"a", "NEAR/10", "\"b c\""}));
+}
+
+TEST(SearchTestSuit, TokenizerTest) {
+  // The indexer used to split lines into words with a stringstream and
+  // normalize them one by one, the tokenizer must give the same terms.
+  auto reference = [](const std::string& text) {
+    std::vector<std::pair<std::string, size_t>> terms;
+    std::istringstream input(text);
+    size_t line = 0;
+    for (std::string str; std::getline(input, str);) {
+      ++line;
+      std::stringstream words(str);
+      for (std::string term; words >> term;) {
+        if (NormalizeTerm(term)) {
+          terms.emplace_back(term, line);
+        }
+      }
+    }
+    return terms;
+  };
+  auto tokenize = [](std::string text) {
+    std::vector<std::pair<std::string, size_t>> terms;
+    Tokenizer tokenizer(text.data(), text.data() + text.size());
+    for (std::string_view term; tokenizer.Next(term);) {
+      terms.emplace_back(term, tokenizer.Line());
+    }
+    return terms;
+  };
+  std::vector<std::string> texts{
+      "",
+      "std::vector<int> V;\n\n  return -x_1 - _ ;\r\n",
+      "\t\vNoSpace\fAtEnd",
+      std::string(100, 'A') + "!" + std::string(70, 'b') + "\n" +
+          std::string(40, ' ') + "\n\n" + std::string(33, '-'),
+      std::string("caf\xc3\xa9 \x01\x7f\x80 \0 z", 15)};
+  uint64_t seed = 1;
+  const std::string alphabet = "aZ09 \n\t\r-_.,;:<>()\"'\x01\x80\xff";
+  for (int i = 0; i < 300; ++i) {
+    std::string text;
+    size_t size = i % 50 == 0 ? 5000 : i % 200;
+    for (size_t j = 0; j < size; ++j) {
+      seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+      size_t r = seed >> 33;
+      // Long runs of letters or spaces reach the vectorized paths.
+      text += r % 4 == 0 ? std::string(r % 70, r % 8 ? 'q' : ' ')
+                         : std::string(1, alphabet[r % alphabet.size()]);
+    }
+    texts.push_back(text);
+  }
+  for (const auto& text : texts) {
+    ASSERT_EQ(tokenize(text), reference(text)) << text;
+  }
+}
+
+TEST(SearchTestSuit, BoundedQueueTest) {
+  BoundedQueue<size_t> queue(2);
+  std::thread producer([&queue]() {
+    for (size_t i = 0; i < 1000; ++i) {
+      queue.Push(i);
+    }
+    queue.Close();
+  });
+  size_t expected = 0;
+  for (size_t item; queue.Pop(item); ++expected) {
+    ASSERT_EQ(item, expected);
+  }
+  producer.join();
+  ASSERT_EQ(expected, 1000);
+  auto stats = queue.Stats();
+  ASSERT_EQ(stats.capacity, 2);
+  ASSERT_EQ(stats.pushes, 1000);
+  ASSERT_LE(stats.occupancy, 2 * stats.pushes);
+  size_t item;
+  ASSERT_FALSE(queue.Pop(item));
+}
+
+TEST(SearchTestSuit, QueryStatsTest) {
+  std::filesystem::remove_all("stats_files");
+  std::filesystem::create_directories("stats_files");
+  std::ofstream("stats_files/a.txt") << "vector list\nfor\n";
+  std::ofstream("stats_files/b.txt") << "list for while\n";
+  BuildIndex("stats_info/", {"-i", "stats_files"});
+  SimpleSearchEngine search("stats_info/");
+  search.SetPostingCacheSize(0);
+  std::ostringstream stats;
+  search.SetStatsOutput(&stats);
+  std::ostringstream out;
+  std::string query = "list AND (\"for\" OR missing)";
+  search.Request(query, 1, out);
+  const QueryStats& last = search.LastStats();
+  ASSERT_FALSE(last.cached);
+  ASSERT_EQ(last.terms, 3);
+  ASSERT_EQ(last.found_terms, 2);
+  ASSERT_EQ(last.postings, 4);
+  ASSERT_EQ(last.scored, 2);
+  ASSERT_EQ(last.results, 1);
+  ASSERT_GT(last.reads.term_bytes, 0);
+  ASSERT_GT(last.reads.posting_bytes, 0);
+  ASSERT_GT(last.reads.position_bytes, 0);
+  ASSERT_GE(last.reads.postings, 4);
+  ASSERT_GE(last.total, last.parse + last.lookup + last.evaluate);
+  ASSERT_EQ(stats.str().find(
+                "{\"query\":\"list AND (\\\"for\\\" OR missing)\",\"k\":1,"
+                "\"cached\":false,"),
+            0);
+  query = "(missing OR \"for\") AND list";
+  search.Request(query, 1, out);
+  ASSERT_TRUE(search.LastStats().cached);
+  ASSERT_EQ(search.LastStats().reads.posting_bytes, 0);
+  const SessionStats& session = search.Session();
+  ASSERT_EQ(session.queries, 2);
+  ASSERT_EQ(session.cache_hits, 1);
+  ASSERT_EQ(session.totals.scored, 2);
+
+  LatencyHistogram histogram;
+  for (int i = 1; i <= 100; ++i) {
+    histogram.Add(i * 1e-3);
+  }
+  ASSERT_EQ(histogram.Count(), 100);
+  ASSERT_GE(histogram.Quantile(0.5), 50e-3);
+  ASSERT_LE(histogram.Quantile(0.5), 50e-3 * 1.1);
+  ASSERT_GE(histogram.Quantile(0.99), 99e-3);
+  ASSERT_LE(histogram.Quantile(0.99), 99e-3 * 1.1);
+}
+
+TEST(SearchTestSuit, BatchTest) {
+  std::filesystem::remove_all("batch_files");
+  std::filesystem::create_directories("batch_files");
+  for (int i = 0; i < 40; ++i) {
+    std::ofstream file("batch_files/" + std::to_string(i) + ".txt");
+    for (int j = 0; j < 300; ++j) {
+      file << "w" << (i * 7 + j * j) % 37 << (j % 9 ? ' ' : '\n');
+    }
+  }
+  BuildIndex("batch_info/", {"-i", "batch_files"});
+  std::vector<std::pair<size_t, std::string>> requests;
+  for (int i = 0; i < 200; ++i) {
+    std::string a = "w" + std::to_string(i % 37);
+    std::string b = "w" + std::to_string(i * 5 % 41);
+    const char* ops[] = {" OR ", " AND ", " NEAR/3 ", " AND ("};
+    std::string request = a + ops[i % 4] + b + (i % 4 == 3 ? ")" : "");
+    if (i % 10 == 0) {
+      request = "\"" + a + " " + b + "\"";
+    } else if (i % 23 == 0) {
+      request = a + " AND";
+    }
+    requests.emplace_back(i % 7 + 1, request);
+  }
+  auto run = [&requests](size_t threads) {
+    SimpleSearchEngine search("batch_info/");
+    search.SetPostingCacheSize(1 << 12);
+    std::ostringstream out;
+    std::ostringstream err;
+    search.Batch(requests, threads, out, err);
+    EXPECT_EQ(search.Session().queries, 192);
+    return out.str() + err.str();
+  };
+  std::string sequential = run(1);
+  ASSERT_EQ(run(4), sequential);
+  SimpleSearchEngine search("batch_info/");
+  std::ostringstream out;
+  std::ostringstream err;
+  for (auto [k, request] : requests) {
+    search.Request(request, k, out, err);
+  }
+  ASSERT_EQ(sequential, out.str() + err.str());
+}
+
+TEST(SearchTestSuit, QueryThreadsTest) {
+  std::filesystem::remove_all("range_files");
+  std::filesystem::create_directories("range_files");
+  for (int i = 0; i < 400; ++i) {
+    std::ofstream file("range_files/" + std::to_string(1000 + i) + ".txt");
+    for (int j = 0; j < 60; ++j) {
+      file << "w" << (i * 11 + j * j) % (j % 3 ? 13 : 29)
+           << (j % 9 ? ' ' : '\n');
+    }
+  }
+  BuildIndex("range_info/", {"-i", "range_files"});
+  std::vector<std::string> requests{
+      "w1 OR w2",    "w1 OR w5 OR w20 OR w28", "w3 AND w4", "(w7 OR w8) AND w0",
+      "\"w1 w4\"", "w2 NEAR/2 w9",           "w27 OR w28"};
+  auto run = [&requests](size_t threads, bool exhaustive) {
+    SimpleSearchEngine search("range_info/");
+    search.SetCacheSize(0);
+    search.SetExhaustive(exhaustive);
+    search.SetQueryThreads(threads, 0);
+    std::string result;
+    size_t scored = 0;
+    for (size_t k : {1, 5, 50, 1000}) {
+      for (std::string request : requests) {
+        std::ostringstream out;
+        search.Request(request, k, out);
+        result += out.str();
+        scored += search.LastStats().scored;
+      }
+    }
+    return std::make_pair(result, scored);
+  };
+  for (bool exhaustive : {false, true}) {
+    auto [sequential, scored] = run(1, exhaustive);
+    auto [parallel, parallel_scored] = run(3, exhaustive);
+    ASSERT_EQ(parallel, sequential);
+    if (exhaustive) {
+      ASSERT_EQ(parallel_scored, scored);
+    }
+  }
+}
+
+TEST(SearchTestSuit, ShardTest) {
+  std::filesystem::remove_all("shard_files");
+  std::filesystem::create_directories("shard_files/a");
+  std::filesystem::create_directories("shard_files/b");
+  for (int i = 0; i < 300; ++i) {
+    std::ofstream file("shard_files/" + std::string(i % 3 ? "a/" : "b/") +
+                       std::to_string(1000 + i) + ".txt");
+    for (int j = 0; j < 40; ++j) {
+      file << "w" << (i * 7 + j * j) % (j % 4 ? 11 : 23)
+           << (j % 7 ? ' ' : '\n');
+    }
+  }
+  BuildIndex("shard_info/", {"-i", "shard_files", "--shards", "3"});
+  ASSERT_TRUE(std::filesystem::exists("shard_info/shards.bin"));
+  ASSERT_TRUE(std::filesystem::exists("shard_info/shard_2/info.bin"));
+  BuildIndex("single_info/", {"-i", "shard_files"});
+  std::vector<std::string> requests{
+      "w1 OR w2",  "w1 OR w5 OR w20 OR w22", "w3 AND w4", "(w7 OR w8) AND w0",
+      "\"w1 w4\"", "w2 NEAR/2 w9",           "w21 OR w22", "missing"};
+  auto run = [&requests](const std::string& directory, bool exhaustive) {
+    SimpleSearchEngine search(directory);
+    search.SetExhaustive(exhaustive);
+    std::string result;
+    for (size_t k : {1, 5, 50, 1000}) {
+      for (std::string request : requests) {
+        std::ostringstream out;
+        search.Request(request, k, out);
+        result += out.str();
+      }
+    }
+    return result;
+  };
+  for (bool exhaustive : {false, true}) {
+    ASSERT_EQ(run("shard_info/", exhaustive), run("single_info/", exhaustive));
+  }
+  // After an update tied results are ordered by DID in the single index and
+  // by path across shards, so only whole result sets compare.
+  for (int i = 0; i < 300; i += 7) {
+    std::string path = "shard_files/" + std::string(i % 3 ? "a/" : "b/") +
+                       std::to_string(1000 + i) + ".txt";
+    if (i % 2) {
+      std::filesystem::remove(path);
+    } else {
+      std::ofstream(path) << "w1 w2 w3\nw4 w1\n";
+    }
+  }
+  std::ofstream("shard_files/0999.txt") << "w1 w4 w2\n";
+  auto run_all = [&requests](const std::string& directory) {
+    SimpleSearchEngine search(directory);
+    std::vector<std::vector<std::string>> results;
+    for (std::string request : requests) {
+      std::ostringstream out;
+      search.Request(request, 1000, out);
+      std::istringstream lines(out.str());
+      std::vector<std::string>& result = results.emplace_back();
+      for (std::string line; std::getline(lines, line);) {
+        result.push_back(line);
+      }
+      std::sort(result.begin(), result.end());
+    }
+    return results;
+  };
+  BuildIndex("single_info/", {"-i", "shard_files", "-u"});
+  BuildIndex("shard_info/", {"-i", "shard_files", "--shards", "3", "-u"});
+  ASSERT_TRUE(std::filesystem::exists("shard_info/shard_0/delta_1"));
+  ASSERT_EQ(run_all("shard_info/"), run_all("single_info/"));
+  BuildIndex("shard_info/", {"-i", "shard_files"});
+  ASSERT_FALSE(std::filesystem::exists("shard_info/shards.bin"));
+  BuildIndex("single_info/", {"-i", "shard_files"});
+  ASSERT_EQ(run("shard_info/", false), run("single_info/", false));
+}
+
+TEST(SearchTestSuit, NoShardsTest) {
+  std::filesystem::create_directories("no_shard_info");
+  std::ofstream("no_shard_info/shards.bin", std::ios::binary) << '\0' << '\1';
+  ASSERT_EQ(Query("no_shard_info/", 10, "word"), "");
+}
+
+TEST(SearchTestSuit, LiveDfTest) {
+  std::filesystem::remove_all("live_files");
+  std::filesystem::create_directories("live_files");
+  for (int i = 0; i < 4000; ++i) {
+    std::ofstream file("live_files/" + std::to_string(10000 + i) + ".txt");
+    file << "common" << (i % 1999 == 0 ? " rare" : "") << '\n';
+  }
+  BuildIndex("live_info/", {"-i", "live_files"});
+  SimpleSearchEngine search("live_info/");
+  search.SetPostingCacheSize(0);
+  std::string request = "common AND rare";
+  std::ostringstream out;
+  search.Request(request, 10, out);
+  ASSERT_EQ(out.str(),
+            "live_files/13998.txt 1 1 \nlive_files/11999.txt 1 1 \n"
+            "live_files/10000.txt 1 1 \n");
+  // Nothing is deleted, so df comes from the dictionary and the common term
+  // is only skipped through.
+  ASSERT_LT(search.LastStats().reads.postings, 1000);
+  // A deletion leaves df to the dictionary as well.
+  std::filesystem::remove("live_files/11999.txt");
+  BuildIndex("live_info/", {"-i", "live_files", "-u"});
+  out.str("");
+  search.Request(request, 10, out);
+  ASSERT_EQ(out.str(),
+            "live_files/13998.txt 1 1 \nlive_files/10000.txt 1 1 \n");
+  ASSERT_LT(search.LastStats().reads.postings, 1000);
+}